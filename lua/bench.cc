@@ -0,0 +1,267 @@
+#include "luainterface.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+
+#include <iostream>
+using namespace std;
+
+//
+// luax-bench: micro-benchmarks of the interface
+//
+// usage: luax-bench [filter]     (only the benchmarks whose name contains `filter`)
+//
+
+static const char* filter = nullptr;
+
+// C++ heap allocations (the Lua state uses its own allocator, not counted)
+static size_t allocations = 0;
+
+void* operator new(size_t size)
+{
+    ++allocations;
+    if(void* p = malloc(size ? size : 1)) {
+        return p;
+    }
+    throw bad_alloc();
+}
+
+void operator delete(void* p) noexcept { free(p); }
+void operator delete(void* p, size_t) noexcept { free(p); }
+
+
+// runs `f` n times, and prints the time and the C++ allocations of each run
+template<class F> static void
+Bench(const char* name, int n, F f)
+{
+    if(filter && !strstr(name, filter)) {
+        return;
+    }
+    f();     // warm up
+    size_t allocated = allocations;
+    auto start = chrono::steady_clock::now();
+    for(int i=0; i<n; ++i) {
+        f();
+    }
+    double ns = chrono::duration<double, nano>(chrono::steady_clock::now() - start).count();
+    printf("%-40s %12.1f ns/op %8.2f allocs/op\n", name, ns / n,
+            static_cast<double>(allocations - allocated) / n);
+}
+
+
+/*
+ * calls
+ */
+
+// scalar and C string parameters (`make test` checks that they don't allocate)
+static void
+BenchCalls(lua::LuaInterface& luax)
+{
+    luax.Do("function bench_add(a, b, s) return a + b + #s end; "
+            "function bench_add2(a, b, s) return a + b, #s end");
+
+    double r = 0;
+    Bench("CallGlobalFunction<double>(3 params)", 100000, [&]() {
+        r += luax.CallGlobalFunction<double>("bench_add", 1.0, 2, "abc");
+    });
+    Bench("CallGlobalFunction<tuple>(3 params)", 100000, [&]() {
+        tuple<double, int> t = luax.CallGlobalFunction<tuple<double, int>>("bench_add2", 1.0, 2, "abc");
+        r += get<0>(t) + get<1>(t);
+    });
+    if(r < 0) {
+        puts("");
+    }
+}
+
+
+/*
+ * classes
+ */
+
+static void
+BenchIsA(lua::LuaInterface& luax)
+{
+    luax.Do("Animal = class(); Dog = class(Animal); bench_dog = Dog()");
+    lua::ClassRef animal = luax.ResolveClass("Animal"),
+                  dog = luax.ResolveClass("Dog");
+
+    luax.PushGlobal("bench_dog");
+    bool r = false;
+    Bench("IsA(string), same class", 1000000, [&]() { r ^= luax.IsA("Dog"); });
+    Bench("IsA(ClassRef), same class", 1000000, [&]() { r ^= luax.IsA(dog); });
+    Bench("IsA(string), base class", 1000000, [&]() { r ^= luax.IsA("Animal"); });
+    Bench("IsA(ClassRef), base class", 1000000, [&]() { r ^= luax.IsA(animal); });
+    luax.Pop();
+
+    luax.ReleaseClass(animal);
+    luax.ReleaseClass(dog);
+    if(r) {
+        puts("");      // (keeps the results alive)
+    }
+}
+
+
+/*
+ * table pool: the tables pushed and released, with and without the pool
+ */
+
+// Lua memory allocated by `n` runs of `f`, with the collector stopped: the
+// garbage the runs leave to the GC
+template<class F> static double
+LuaBytesPerOp(lua::LuaInterface& luax, int n, F f)
+{
+    lua_State* L = luax.L();
+    auto bytes = [&]() { return lua_gc(L, LUA_GCCOUNT, 0) * 1024.0 + lua_gc(L, LUA_GCCOUNTB, 0); };
+
+    lua_gc(L, LUA_GCCOLLECT, 0);
+    lua_gc(L, LUA_GCSTOP, 0);
+    double before = bytes();
+    for(int i=0; i<n; ++i) {
+        f();
+    }
+    double after = bytes();
+    lua_gc(L, LUA_GCRESTART, 0);
+    lua_gc(L, LUA_GCCOLLECT, 0);
+    return (after - before) / n;
+}
+
+
+static void
+BenchTablePool(lua::LuaInterface& luax)
+{
+    luax.Do("if not Point then "
+            "  Point = class(); function Point:__init(x, y) self.x = x; self.y = y end "
+            "end");
+
+    vector<double> v(16, 1.0);
+    Point p;
+    p.x = 1;
+    p.y = 2;
+    auto push_vector = [&]() { luax.Push(v); luax.ReleaseTable(); luax.Pop(); };
+    auto push_point = [&]() { luax.Push(p); luax.ReleaseTable(); luax.Pop(); };
+
+    for(size_t max: { size_t(0), size_t(64) }) {
+        luax.EnableTablePool(max);
+        string pool = max ? " (pool)" : " (no pool)";
+        Bench(("Push(vector<double>(16))" + pool).c_str(), 100000, push_vector);
+        Bench(("Push(Point)" + pool).c_str(), 100000, push_point);
+        string garbage = "Push garbage" + pool;
+        if(!filter || strstr(garbage.c_str(), filter)) {
+            printf("%-40s %12.1f B/op (vector) %6.1f B/op (Point)\n", garbage.c_str(),
+                    LuaBytesPerOp(luax, 1000, push_vector), LuaBytesPerOp(luax, 1000, push_point));
+        }
+    }
+    luax.EnableTablePool(0);
+}
+
+
+/*
+ * functional helpers: the native versions, against the Lua versions they
+ * replaced (as they were in mylib/functional.lua)
+ */
+
+static const char* lua_functional = R"(
+function lua_filter(table, func)
+  local new_table = {}
+  for _,v in ipairs(table) do
+    if func(v) then new_table[#new_table+1] = v end
+  end
+  return new_table
+end
+
+function lua_map(table, func)
+  local new_table = {}
+  for _,v in ipairs(table) do
+    new_table[#new_table+1] = func(v)
+  end
+  return new_table
+end
+
+function lua_partition(table, func)
+  local true_tbl, false_tbl = {}, {}
+  for _,v in ipairs(table) do
+    if func(v) then 
+      true_tbl[#true_tbl+1] = v 
+    else
+      false_tbl[#false_tbl+1] = v
+    end
+  end
+  return true_tbl, false_tbl
+end
+
+function lua_flatten(list)
+  if type(list) ~= "table" then
+    return {list}
+  elseif list.is_a then
+    return {list}
+  end
+  local flat_list = {}
+  for _, elem in ipairs(list) do
+    for _, val in ipairs(lua_flatten(elem)) do
+      flat_list[#flat_list + 1] = val
+    end
+  end
+  return flat_list
+end
+
+bench_list, bench_nested = {}, {}
+for i = 1, 1000 do
+  bench_list[i] = i
+  bench_nested[i] = { i, { i, i } }
+end
+local function even(x) return x % 2 == 0 end
+local function inc(x) return x + 1 end
+
+function bench_filter(f) return #_G[f](bench_list, even) end
+function bench_map(f) return #_G[f](bench_list, inc) end
+function bench_partition(f) return #_G[f](bench_list, even) end
+function bench_flatten(f) return #_G[f](bench_nested) end
+function bench_stream() return stream(bench_list):filter(even):map(inc):sum() end
+function bench_loop()
+  local s = 0
+  for _, v in ipairs(bench_list) do
+    if v % 2 == 0 then s = s + v + 1 end
+  end
+  return s
+end
+)";
+
+static void
+BenchFunctional(lua::LuaInterface& luax)
+{
+    luax.Do(lua_functional);
+
+    int r = 0;
+    for(string f: { "filter", "map", "partition", "flatten" }) {
+        string bench = "bench_" + f, script = "lua_" + f;
+        Bench((f + " (1000 items, C++)").c_str(), 2000, [&]() { r += luax.CallGlobalFunction<int>(bench, f); });
+        Bench((f + " (1000 items, Lua)").c_str(), 2000, [&]() { r += luax.CallGlobalFunction<int>(bench, script); });
+    }
+    Bench("stream filter/map/sum (1000 items)", 2000, [&]() { r += luax.CallGlobalFunction<int>("bench_stream"); });
+    Bench("for loop filter/map/sum (1000 items)", 2000, [&]() { r += luax.CallGlobalFunction<int>("bench_loop"); });
+    if(r == 0) {
+        puts("");
+    }
+}
+
+
+int main(int argc, char* argv[])
+{
+    if(argc > 1) {
+        filter = argv[1];
+    }
+
+    lua::LuaInterface luax([](string const& s, void*) { cerr << s << endl; exit(1); }, nullptr);
+    BenchCalls(luax);
+    BenchIsA(luax);
+    BenchTablePool(luax);
+    BenchFunctional(luax);
+    luax.EnsureStackEmpty();
+
+    return 0;
+}
+
+// vim: ts=4:sw=4:sts=4:expandtab
@@ -0,0 +1,169 @@
+#include "luaasync.h"
+
+extern "C" {
+    #include <lua.h>
+    #include <lauxlib.h>
+    #include <lualib.h>
+}
+
+#include <cassert>
+
+#include "luainterface.h"
+
+namespace lua {
+
+/*
+ * script compiler
+ */
+
+ScriptCompiler::~ScriptCompiler()
+{
+    {
+        lock_guard<mutex> lock(m);
+        stop = true;
+    }
+    cv.notify_all();
+    if(worker.joinable()) {
+        worker.join();
+    }
+}
+
+
+future<void>
+ScriptCompiler::Compile(string const& filename)
+{
+    Script script;
+    script.filename = filename;
+    future<void> f = script.done.get_future();
+
+    lock_guard<mutex> lock(m);
+    queued.push_back(move(script));
+    if(!worker.joinable()) {
+        worker = thread(&ScriptCompiler::Worker, this);
+    }
+    cv.notify_one();
+    return f;
+}
+
+
+bool
+ScriptCompiler::TakeCompiled(Script& script)
+{
+    lock_guard<mutex> lock(m);
+    if(compiled.empty()) {
+        return false;
+    }
+    script = move(compiled.front());
+    compiled.pop_front();
+    return true;
+}
+
+
+void
+ScriptCompiler::Worker()
+{
+    for(;;) {
+        Script script;
+        {
+            unique_lock<mutex> lock(m);
+            cv.wait(lock, [&] { return stop || !queued.empty(); });
+            if(stop) {
+                return;
+            }
+            script = move(queued.front());
+            queued.pop_front();
+        }
+
+        lua_State* L = luaL_newstate();
+        if(!L) {
+            script.error = script.filename + ": not enough memory to compile";
+        } else if(luaL_loadfile(L, script.filename.c_str()) == LUA_OK) {
+            lua_dump(L, [](lua_State*, const void* p, size_t sz, void* ud) {
+                reinterpret_cast<string*>(ud)->append(reinterpret_cast<const char*>(p), sz);
+                return 0;
+            }, &script.bytecode, 0);
+        } else {
+            script.error = lua_tostring(L, -1);
+        }
+        if(L) {
+            lua_close(L);
+        }
+
+        lock_guard<mutex> lock(m);
+        compiled.push_back(move(script));
+    }
+}
+
+
+/*
+ * LuaInterface
+ */
+
+future<void>
+LuaInterface::LoadSourceAsync(string const& filename) const
+{
+    return compiler.Compile(filename);
+}
+
+
+// load and run the scripts compiled so far, in the order they were compiled
+size_t
+LuaInterface::RunCompiledScripts() const
+{
+    size_t n = 0;
+    ScriptCompiler::Script script;
+    while(compiler.TakeCompiled(script)) {
+        ++n;
+        TraceScope trace(tracer, "load", script.filename.c_str());
+        memo.Invalidate();
+
+        // errors go to the future only
+        if(!script.error.empty()) {
+            script.done.set_exception(make_exception_ptr(LuaError(script.error, {}, {})));
+            continue;
+        }
+
+        int top = lua_gettop(L());
+        string chunkname = "@" + script.filename;
+        if(luaL_loadbufferx(L(), script.bytecode.data(), script.bytecode.size(), 
+                    chunkname.c_str(), "b") != LUA_OK) {
+            string error = lua_tostring(L(), -1);
+            Pop();
+            script.done.set_exception(make_exception_ptr(LuaError(error, {}, {})));
+            continue;
+        }
+        if(static_strict) {
+            try {
+                CheckGlobals(script.filename);
+            } catch(LuaError const&) {      // (throw_errors: the chunk is not run)
+                lua_settop(L(), top);
+                script.done.set_exception(current_exception());
+                continue;
+            }
+        }
+
+        int status;
+        try {
+            quiet_errors = !throw_errors;     // (not given to the error callback)
+            status = Call(0, 0);
+            quiet_errors = false;
+        } catch(LuaError const&) {
+            quiet_errors = false;
+            script.done.set_exception(current_exception());
+            continue;
+        }
+        if(status == LUA_OK) {
+            script.done.set_value();
+        } else {
+            Pop();   // error message
+            script.done.set_exception(make_exception_ptr(last_error ? *last_error 
+                        : LuaError("Runtime error", {}, {})));
+        }
+    }
+    return n;
+}
+
+
+}  // namespace lua
+
+// vim: ts=4:sw=4:sts=4:expandtab
@@ -0,0 +1,49 @@
+#ifndef LUA_LUAASYNC_H_
+#define LUA_LUAASYNC_H_
+
+#include <condition_variable>
+#include <deque>
+#include <future>
+#include <mutex>
+#include <string>
+#include <thread>
+using namespace std;
+
+namespace lua {
+
+// compiles scripts to bytecode on a worker thread, each in a scratch
+// lua_State; the bytecode is then loaded by the thread that owns the
+// interface (see LuaInterface::RunCompiledScripts)
+class ScriptCompiler {
+public:
+    struct Script {
+        string        filename;
+        string        bytecode;
+        string        error;       // compilation error (empty: compiled)
+        promise<void> done;        // set when the script has run
+    };
+
+    ScriptCompiler() {}
+    ~ScriptCompiler();
+
+    future<void> Compile(string const& filename);
+    bool TakeCompiled(Script& script);
+
+private:
+    void Worker();
+
+    thread        worker;          // started on the first script
+    mutex         m;
+    condition_variable cv;
+    deque<Script> queued, compiled;
+    bool          stop = false;
+
+    ScriptCompiler(ScriptCompiler const&) = delete;
+    ScriptCompiler& operator=(ScriptCompiler const&) = delete;
+};
+
+}  // namespace lua
+
+#endif  // LUA_LUAASYNC_H_
+
+// vim: ts=4:sw=4:sts=4:expandtab
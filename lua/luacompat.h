@@ -0,0 +1,110 @@
+#ifndef LUA_LUACOMPAT_H_
+#define LUA_LUACOMPAT_H_
+
+// Differences between the Lua backends. The interface is written against the
+// Lua 5.2/5.3 API; when built with LUAX_LUAJIT (`make LUAJIT=1`), the 5.2
+// functions missing from LuaJIT 2.1 are provided here.
+//
+// (included after lua.h, lauxlib.h and lualib.h)
+
+#include <climits>
+#include <cstdint>
+
+#ifdef LUAX_LUAJIT
+extern "C" {
+    #include <luajit.h>
+}
+
+#define LUA_OK                  0
+#define LUA_TCDATA              10           // FFI cdata (not in lua.h)
+
+#define lua_rawlen(L, i)        lua_objlen(L, (i))
+#define lua_pushglobaltable(L)  lua_pushvalue(L, LUA_GLOBALSINDEX)
+#define lua_getuservalue(L, i)  lua_getfenv(L, (i))
+#define lua_setuservalue(L, i)  lua_setfenv(L, (i))
+#define lua_load(L, r, d, n, m) lua_loadx(L, (r), (d), (n), (m))
+
+#ifndef luaL_newlib
+#  define luaL_newlib(L, l)     (lua_createtable(L, 0, sizeof(l)/sizeof((l)[0]) - 1), luaL_setfuncs(L, (l), 0))
+#endif
+
+inline int
+lua_absindex(lua_State* L, int i)
+{
+    return (i > 0 || i <= LUA_REGISTRYINDEX) ? i : lua_gettop(L) + i + 1;
+}
+
+// length with the __len metamethod (lua_objlen ignores it)
+inline int
+luaL_len(lua_State* L, int i)
+{
+    if(luaL_callmeta(L, i, "__len")) {
+        if(!lua_isnumber(L, -1)) {
+            luaL_error(L, "object length is not a number");
+        }
+        int n = static_cast<int>(lua_tonumber(L, -1));
+        lua_pop(L, 1);
+        return n;
+    }
+    return static_cast<int>(lua_objlen(L, i));
+}
+
+// only addition of numbers (metamethods are not called)
+#define LUA_OPADD 0
+inline void
+lua_arith(lua_State* L, int op)
+{
+    (void) op;
+    lua_Number b = lua_tonumber(L, -1),
+               a = lua_tonumber(L, -2);
+    lua_pop(L, 2);
+    lua_pushnumber(L, a + b);
+}
+#endif
+
+// lua_dump has no `strip` argument before 5.3
+#if LUA_VERSION_NUM < 503
+#  define lua_dump(L, w, d, strip) lua_dump(L, (w), (d))
+#endif
+
+#if !defined(LUAX_LUAJIT) && LUA_VERSION_NUM >= 503
+#  define LUAX_INTEGER_SUBTYPE 1
+#else
+#  define LUAX_INTEGER_SUBTYPE 0
+#endif
+
+namespace lua {
+
+// how numbers behave in each backend
+struct NumberTraits {
+#if LUAX_INTEGER_SUBTYPE
+    // integer subtype: integers are exact in the whole int64 range, `3 // 2` is
+    // an integer, and a C++ integer must be pushed as an integer (1, not 1.0)
+    static constexpr bool    integer_subtype  = true;
+    static constexpr int64_t max_exact_integer = INT64_MAX;
+#else
+    // every number is a double: integers are exact up to 2^53, and integral
+    // C++ values are pushed and read as doubles
+    static constexpr bool    integer_subtype  = false;
+    static constexpr int64_t max_exact_integer = int64_t(1) << 53;
+#endif
+
+#ifdef LUAX_LUAJIT
+    static constexpr bool    ffi = true;    // cdata fast paths for Point and double arrays
+#else
+    static constexpr bool    ffi = false;
+#endif
+};
+
+// the `package` field with the module searchers
+#ifdef LUAX_LUAJIT
+#  define LUAX_SEARCHERS "loaders"
+#else
+#  define LUAX_SEARCHERS "searchers"
+#endif
+
+}  // namespace lua
+
+#endif  // LUA_LUACOMPAT_H_
+
+// vim: ts=4:sw=4:sts=4:expandtab
@@ -0,0 +1,434 @@
+#include "luadebugger.h"
+
+extern "C" {
+    #include <lua.h>
+    #include <lauxlib.h>
+    #include <lualib.h>
+}
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstring>
+
+#include "luahelper.h"
+#include "luainterface.h"
+
+namespace lua {
+
+/*
+ * source cache
+ */
+
+SourceCache::~SourceCache()
+{
+    for(auto& f: files) {
+        if(f.second.data) {
+            munmap(const_cast<char*>(f.second.data), f.second.size);
+        }
+    }
+}
+
+
+SourceCache::File const*
+SourceCache::Load(string const& file)
+{
+    auto it = files.find(file);
+    if(it != files.end()) {
+        return &it->second;
+    }
+
+    File f;
+    int fd = open(file.c_str(), O_RDONLY);
+    if(fd < 0) {
+        return nullptr;
+    }
+    struct stat st;
+    if(fstat(fd, &st) == 0 && st.st_size > 0) {
+        void* data = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if(data != MAP_FAILED) {
+            f.data = reinterpret_cast<const char*>(data);
+            f.size = st.st_size;
+        }
+    }
+    close(fd);
+
+    f.lines.push_back(0);
+    for(const char* p = f.data; p && (p = reinterpret_cast<const char*>(memchr(p, '\n', f.data + f.size - p))); ++p) {
+        f.lines.push_back(p - f.data + 1);
+    }
+    return &files.emplace(file, move(f)).first->second;
+}
+
+
+bool
+SourceCache::Line(string const& file, int n, const char** text, size_t* len)
+{
+    File const* f = Load(file);
+    if(!f || n < 1 || static_cast<size_t>(n) > f->lines.size() || f->lines[n-1] >= f->size) {
+        return false;
+    }
+    size_t start = f->lines[n-1],
+           end = static_cast<size_t>(n) < f->lines.size() ? f->lines[n] - 1 : f->size;
+    if(end > start && f->data[end-1] == '\r') {
+        --end;
+    }
+    *text = f->data + start;
+    *len = end - start;
+    return true;
+}
+
+
+/*
+ * debugger
+ */
+
+thread_local Debugger::Cached Debugger::cached;
+
+
+Debugger::~Debugger()
+{
+    Detach();
+}
+
+
+void
+Debugger::AddBreakpoint(lua_State* L, string const& source, int line, function<void()> f)
+{
+    breakpoints.push_back({ source, line, f });
+    for(auto& t: threads) {
+        t.second.stale = true;      // recompute which active functions contain breakpoints
+    }
+    Update(L);
+}
+
+
+void
+Debugger::RemoveBreakpoint(lua_State* L, string const& source, int line)
+{
+    breakpoints.erase(remove_if(begin(breakpoints), end(breakpoints), [&](Breakpoint const& bp) {
+        return bp.source == source && bp.line == line;
+    }), end(breakpoints));
+    for(auto& t: threads) {
+        t.second.stale = true;
+    }
+    Update(L);
+}
+
+
+void
+Debugger::BreakOnNextLine(lua_State* L, function<void()> f)
+{
+    step = NEXT_LINE;
+    step_f = f;
+    Update(L);
+}
+
+
+void
+Debugger::BreakOnNextReturn(lua_State* L, function<void()> f)
+{
+    Update(L);     // attach first, so that the depth is known
+    step = NEXT_RETURN;
+    step_thread = L;
+    step_depth = threads[L].frames.size();
+    step_f = f;
+    Update(L);
+}
+
+
+bool
+Debugger::SourceMatches(Breakpoint const& bp, const char* source) const
+{
+    if(*source == '@') {
+        ++source;
+    }
+    size_t len = strlen(source);
+    return len >= bp.source.size() && bp.source.compare(0, string::npos, source + len - bp.source.size()) == 0;
+}
+
+
+bool
+Debugger::HasBreakpoint(lua_Debug const& ar) const
+{
+    for(auto const& bp: breakpoints) {
+        bool in_function = (strcmp(ar.what, "main") == 0)
+                        || (bp.line >= ar.linedefined && bp.line <= ar.lastlinedefined);
+        if(in_function && SourceMatches(bp, ar.source)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+
+// number of active functions (lua_getstack walks the levels, so they are
+// searched by bisection). Only to build the frames again.
+size_t
+Debugger::StackDepth(lua_State* L)
+{
+    lua_Debug ar;
+    if(!lua_getstack(L, 0, &ar)) {
+        return 0;
+    }
+    int lo = 0, hi = 1;         // level `lo` exists, level `hi` may not
+    while(lua_getstack(L, hi, &ar)) {
+        lo = hi;
+        hi *= 2;
+    }
+    while(hi - lo > 1) {
+        int mid = lo + (hi - lo) / 2;
+        if(lua_getstack(L, mid, &ar)) {
+            lo = mid;
+        } else {
+            hi = mid;
+        }
+    }
+    return static_cast<size_t>(lo) + 1;
+}
+
+
+// whether there are exactly `n` active functions
+bool
+Debugger::HasDepth(lua_State* L, size_t n)
+{
+    lua_Debug ar;
+    return (n == 0 || lua_getstack(L, static_cast<int>(n) - 1, &ar)) && !lua_getstack(L, static_cast<int>(n), &ar);
+}
+
+
+// build the frame list from the current stack
+void
+Debugger::Attach(lua_State* L, Thread& t)
+{
+    size_t n = StackDepth(L);
+    t.frames.assign(n, PLAIN);
+    lua_Debug ar;
+    for(size_t level=0; level<n; ++level) {
+        lua_getstack(L, static_cast<int>(level), &ar);
+        t.frames[n-level-1] = FrameOf(L, &ar);
+    }
+    t.stale = false;
+}
+
+
+// the kind of frame of the function of `ar` (getinfo "S" is done here)
+char
+Debugger::FrameOf(lua_State* L, lua_Debug* ar)
+{
+    lua_getinfo(L, "S", ar);
+    if(ar->what[0] == 'C') {
+        lua_getinfo(L, "f", ar);
+        CFunction f = lua_tocfunction(L, -1);
+        lua_pop(L, 1);
+        return (f && (f == pcall || f == xpcall)) ? PROTECTED : PLAIN;
+    }
+    return HasBreakpoint(*ar) ? BREAKPOINT : PLAIN;
+}
+
+
+void
+Debugger::Unwound(lua_State* L)
+{
+    auto it = threads.find(L);
+    if(it != threads.end()) {
+        it->second.stale = true;
+    }
+}
+
+
+void
+Debugger::Update(lua_State* L)
+{
+    if(threads.empty()) {      // attaching: find the functions that catch errors
+        lua_getglobal(L, "pcall");
+        pcall = lua_tocfunction(L, -1);
+        lua_getglobal(L, "xpcall");
+        xpcall = lua_tocfunction(L, -1);
+        lua_pop(L, 2);
+    }
+    Update(L, threads[L]);
+}
+
+
+void
+Debugger::Update(lua_State* L, Thread& t)
+{
+    if(breakpoints.empty() && step == NONE) {
+        lua_sethook(L, nullptr, 0, 0);
+        Detach();      // (the hooks of the other threads remove themselves when they run)
+        return;
+    }
+
+    if(!t.mask || t.stale) {
+        Attach(L, t);
+    }
+    bool line = (step == NEXT_LINE)
+             || (step == NEXT_RETURN && L == step_thread && t.frames.size() <= step_depth)
+             || (!t.frames.empty() && t.frames.back() == BREAKPOINT);
+    int new_mask = LUA_MASKCALL | LUA_MASKRET | (line ? LUA_MASKLINE : 0);
+    if(new_mask != t.mask) {
+        lua_sethook(L, Hook, new_mask, 0);
+        t.mask = new_mask;
+    }
+}
+
+
+void
+Debugger::Detach()
+{
+    threads.clear();
+    step_thread = nullptr;
+    if(cached.d == this) {
+        cached = Cached();
+    }
+}
+
+
+// the depth is the size of the frames, moved by one on each event: the stack
+// is only walked to build the frames again
+void
+Debugger::Hook(lua_State* L, lua_Debug* ar)
+{
+    if(cached.L != L) {
+        Debugger& d = LuaInterface::get(L).debugger;
+        cached.L = L;
+        cached.d = &d;
+        cached.t = &d.threads[L];      // (elements of an unordered_map don't move)
+    }
+    Debugger& d = *cached.d;
+    Thread& t = *cached.t;
+    d.current = L;
+
+    lua_Debug bottom;
+    switch(ar->event) {
+        case LUA_HOOKCALL:
+            // a call at the bottom of the stack while frames are tracked: they were
+            // left by an error (or the thread was collected, and its address reused)
+            if(t.stale || (!t.frames.empty() && !lua_getstack(L, 1, &bottom))) {
+                d.Attach(L, t);
+            } else {
+                t.frames.push_back(d.FrameOf(L, ar));
+            }
+            break;
+#ifdef LUA_HOOKTAILCALL
+        case LUA_HOOKTAILCALL:
+            if(t.stale || t.frames.empty()) {
+                d.Attach(L, t);
+            } else {
+                t.frames.back() = d.FrameOf(L, ar);
+            }
+            break;
+#else
+        case LUA_HOOKTAILRET:      // (Lua 5.1 API: tail calls push a frame, popped here)
+#endif
+        case LUA_HOOKRET:
+            // pcall and xpcall may return after an error unwound the frames above them
+            if(t.stale || t.frames.empty()
+                    || (t.frames.back() == PROTECTED && !HasDepth(L, t.frames.size()))) {
+                d.Attach(L, t);
+            }
+            if(!t.frames.empty()) {
+                t.frames.pop_back();
+            }
+            break;
+        case LUA_HOOKLINE:
+            if(t.stale) {
+                d.Attach(L, t);
+            }
+            if(d.step == NEXT_LINE || (d.step == NEXT_RETURN && L == d.step_thread && t.frames.size() <= d.step_depth)) {
+                function<void()> f = move(d.step_f);
+                d.step = NONE;
+                d.Update(L);
+                f();
+                return;
+            }
+            if(!t.frames.empty() && t.frames.back() == BREAKPOINT) {
+                lua_getinfo(L, "Sl", ar);
+                for(size_t i=0; i<d.breakpoints.size(); ++i) {
+                    if(d.breakpoints[i].line == ar->currentline && d.SourceMatches(d.breakpoints[i], ar->source)) {
+                        function<void()> f = d.breakpoints[i].f;
+                        f();
+                        break;
+                    }
+                }
+            }
+            break;
+    }
+    d.Update(L, t);
+}
+
+
+/*
+ * LuaInterface
+ */
+
+void
+LuaInterface::CallOnNextLine(function<void()> f) const
+{
+    debugger.BreakOnNextLine(L(), f);
+}
+
+
+void
+LuaInterface::CallOnNextReturn(function<void()> f) const
+{
+    debugger.BreakOnNextReturn(L(), f);
+}
+
+
+void
+LuaInterface::AddBreakpoint(string const& source, int line, function<void()> f) const
+{
+    debugger.AddBreakpoint(L(), source, line, f);
+}
+
+
+void
+LuaInterface::RemoveBreakpoint(string const& source, int line) const
+{
+    debugger.RemoveBreakpoint(L(), source, line);
+}
+
+
+void initialize_debugger(LuaInterface const& luax)
+{
+    // debug_step(f) -> call `f` on the next line executed (through the hook of the
+    // debugger: debug.sethook would replace it)
+    luax.RegisterFunction("debug_step", [](lua_State* L) {
+        luaL_checktype(L, 1, LUA_TFUNCTION);
+        lua_settop(L, 1);
+        int ref = luaL_ref(L, LUA_REGISTRYINDEX);
+        LuaInterface& luax = LuaInterface::get(L);
+        luax.debugger.BreakOnNextLine(L, [&luax, ref]() {
+            lua_State* T = luax.debugger.Current();
+            lua_rawgeti(T, LUA_REGISTRYINDEX, ref);
+            luaL_unref(T, LUA_REGISTRYINDEX, ref);
+            lua_call(T, 0, 0);
+        });
+        return 0;
+    });
+
+
+    // source_line(file, n) -> text of the line, or nil
+    luax.RegisterFunction("source_line", [](lua_State* L) {
+        const char* file = luaL_checkstring(L, 1);
+        int n = static_cast<int>(luaL_checkinteger(L, 2));
+        const char* text;
+        size_t len;
+        if(LuaInterface::get(L).debugger.Sources().Line(file, n, &text, &len)) {
+            lua_pushlstring(L, text, len);
+        } else {
+            lua_pushnil(L);
+        }
+        return 1;
+    });
+}
+
+
+}  // namespace lua
+
+// vim: ts=4:sw=4:sts=4:expandtab
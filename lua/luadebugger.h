@@ -0,0 +1,115 @@
+#ifndef LUA_LUADEBUGGER_H_
+#define LUA_LUADEBUGGER_H_
+
+#include <functional>
+#include <string>
+#include <unordered_map>
+#include <vector>
+using namespace std;
+
+struct lua_State;
+struct lua_Debug;
+
+namespace lua {
+
+// source files mapped in memory, with an index of line offsets
+class SourceCache {
+public:
+    SourceCache() {}
+    ~SourceCache();
+
+    bool Line(string const& file, int n, const char** text, size_t* len);
+
+private:
+    struct File {
+        const char*    data = nullptr;
+        size_t         size = 0;
+        vector<size_t> lines;       // offset of each line
+    };
+    File const* Load(string const& file);
+
+    unordered_map<string, File> files;
+
+    SourceCache(SourceCache const&) = delete;
+    SourceCache& operator=(SourceCache const&) = delete;
+};
+
+
+// breakpoints and stepping. The call depth is tracked with call/return
+// hooks. No return hook runs for the frames unwound by an error: the frames
+// are built again from lua_getstack when the error may have happened (the
+// return of pcall/xpcall, an error reaching the host, or a call at the
+// bottom of the stack while frames are tracked). Each coroutine has its own
+// frames and hook. The line hook is only enabled inside functions that
+// contain a breakpoint (or while stepping, at the depth being stepped). With
+// no breakpoints and no stepping, no hook is installed at all.
+class Debugger {
+public:
+    ~Debugger();
+
+    void AddBreakpoint(lua_State* L, string const& source, int line, function<void()> f);
+    void RemoveBreakpoint(lua_State* L, string const& source, int line);
+    void BreakOnNextLine(lua_State* L, function<void()> f);
+    void BreakOnNextReturn(lua_State* L, function<void()> f);
+
+    lua_State* Current() const { return current; }     // thread of the hook running
+    SourceCache& Sources() { return sources; }
+    void Unwound(lua_State* L);         // an error is unwinding the stack of L (see Traceback)
+
+private:
+    enum Step { NONE, NEXT_LINE, NEXT_RETURN };
+
+    struct Breakpoint {
+        string           source;
+        int              line;
+        function<void()> f;
+    };
+
+    enum Frame : char { PLAIN, BREAKPOINT, PROTECTED };    // PROTECTED: pcall, xpcall
+
+    struct Thread {
+        vector<char> frames;        // per call depth: a Frame
+        int          mask = 0;      // current hook mask (0: not attached)
+        bool         stale = true;  // the frames must be built again
+    };
+
+    // the thread of the last hook that ran (on the thread of the interface)
+    struct Cached {
+        lua_State* L = nullptr;
+        Debugger*  d = nullptr;
+        Thread*    t = nullptr;
+    };
+    static thread_local Cached cached;
+
+    typedef int (*CFunction)(lua_State*);
+
+    static void Hook(lua_State* L, lua_Debug* ar);
+    static size_t StackDepth(lua_State* L);
+    static bool HasDepth(lua_State* L, size_t n);
+    void Attach(lua_State* L, Thread& t);
+    char FrameOf(lua_State* L, lua_Debug* ar);
+    void Update(lua_State* L);
+    void Update(lua_State* L, Thread& t);
+    void Detach();
+    bool HasBreakpoint(lua_Debug const& ar) const;
+    bool SourceMatches(Breakpoint const& bp, const char* source) const;
+
+    vector<Breakpoint> breakpoints;
+    unordered_map<lua_State*, Thread> threads;     // (a thread that was collected is
+                                                   // detected by Sync if its address is reused)
+    lua_State*         current = nullptr;
+    CFunction          pcall = nullptr, xpcall = nullptr;
+
+    Step               step = NONE;
+    lua_State*         step_thread = nullptr;
+    size_t             step_depth = 0;
+    function<void()>   step_f;
+
+    SourceCache        sources;
+};
+
+}  // namespace lua
+
+#endif  // LUA_LUADEBUGGER_H_
+
+// vim: ts=4:sw=4:sts=4:expandtab
@@ -1,15 +1,16 @@
-
 #include "luainterface.h"
 
 #if defined(__GNUC__) && !defined(__MINGW32__) && defined(DEBUG)
+#  define LUAX_CPP_BACKTRACE
 #  include <cxxabi.h>
 #  include <execinfo.h>
 #endif
 
 #include <cstdlib>
+#include <mutex>
 #include <sstream>
 #include <iostream>
-#include <regex>
+#include <unordered_map>
 
 extern "C" {
     #include <lua.h>
@@ -23,84 +24,225 @@ extern "C" {
 
 namespace lua {
 
-void
-LuaInterface::Error(string s) const
+/*
+ * LuaError: the frames are captured raw when the error happens, and only
+ * formatted (and, for C++ frames, symbolized) when someone reads them.
+ */
+
+LuaError::LuaError(string message, vector<LuaFrame> lua_frames, vector<void*> cpp_frames)
+    : message(move(message)), lua_frames(move(lua_frames)), cpp_frames(move(cpp_frames))
 {
-    lua_pushstring(L, s.c_str());
-    lua_insert(L, 1);
-    Traceback(L);
 }
 
 
-int 
-LuaInterface::Traceback(lua_State* l)
+// only copies what would not outlive the state (the source and the name of
+// each frame, in one buffer); the frames are formatted by LuaFrames()
+LuaError
+LuaError::Capture(lua_State* l, string message, int level)
 {
-    const char *msg = lua_tostring(l, 1);
-    if (msg) {
-        luaL_traceback(l, l, msg, 1);
-    } else if (!lua_isnoneornil(l, 1)) {
-        if (!luaL_callmeta(l, 1, "__tostring")) {
-            lua_pushliteral(l, "(no error message)");
+    static const int MAX_LUA_FRAMES = 64;
+
+    LuaError error(move(message), {}, {});
+    lua_Debug ar;
+    int n = 0;
+    while(n < MAX_LUA_FRAMES && lua_getstack(l, level+n, &ar)) {
+        ++n;
+    }
+    error.raw_frames.reserve(n);
+    error.raw_strings.reserve(n * 32);
+    for(int i=level; i < level+n && lua_getstack(l, i, &ar); ++i) {
+        lua_getinfo(l, "Sln", &ar);
+        RawFrame f = { ar.what ? ar.what : "", ar.namewhat ? ar.namewhat : "",
+                       0, 0, ar.currentline, ar.linedefined };
+        f.source = static_cast<uint32_t>(error.raw_strings.size());
+        error.raw_strings.append(ar.short_src).push_back('\0');
+        f.name = static_cast<uint32_t>(error.raw_strings.size());
+        error.raw_strings.append(ar.name ? ar.name : "").push_back('\0');
+        error.raw_frames.push_back(f);
+    }
+
+#ifdef LUAX_CPP_BACKTRACE
+    void* buffer[100];
+    int nptrs = backtrace(buffer, 100);
+    error.cpp_frames.assign(buffer, buffer + nptrs);
+#endif
+
+    return error;
+}
+
+
+vector<LuaError::LuaFrame> const&
+LuaError::LuaFrames() const
+{
+    if(lua_frames.empty()) {
+        lua_frames.reserve(raw_frames.size());
+        for(auto const& f: raw_frames) {
+            lua_frames.push_back({ &raw_strings[f.source], f.what, &raw_strings[f.name],
+                                   f.namewhat, f.currentline, f.linedefined });
         }
     }
-    // get lua backtrace
+    return lua_frames;
+}
+
+
+string
+LuaError::LuaTraceback() const
+{
     stringstream ss;
-    ss << "LUA STACK\n=========\n" + string(lua_tostring(l, -1)) + "\n\n";
-    // get C++ backtrace
-#if defined(__GNUC__) && !defined(__MINGW32__) && defined(DEBUG)
-    ss << "C++ STACK\n=========";
-    void *buffer[100];
-    char** strings;
-    int nptrs = backtrace(buffer, 100);
-    strings = backtrace_symbols(buffer, nptrs);
-    string prev = "";
-    for(int i=0; i<nptrs; ++i) {
-        string s = Demangle(string(strings[i]));
-        if(s != prev) {
-            ss << "\n\033[1;32m.\033[0m " + s;
+    ss << message << "\nstack traceback:";
+    for(auto const& f: LuaFrames()) {
+        ss << "\n\t" << f.source << ":";
+        if(f.currentline > 0) {
+            ss << f.currentline << ":";
+        }
+        if(!f.namewhat.empty()) {
+            ss << " in function '" << f.name << "'";
+        } else if(f.what == "main") {
+            ss << " in main chunk";
+        } else if(f.what == "C") {
+            ss << " in ?";
+        } else {
+            ss << " in function <" << f.source << ":" << f.linedefined << ">";
         }
-        prev = s;
     }
-    free(strings);
+    return ss.str();
+}
+
+
+vector<string>
+LuaError::CppTraceback() const
+{
+    // symbols are cached for the whole process, since return addresses repeat a lot
+    static mutex cache_mutex;
+    static unordered_map<void*, string> cache;
+
+    vector<string> frames;
+    lock_guard<mutex> lock(cache_mutex);
+    for(void* addr: cpp_frames) {
+        auto it = cache.find(addr);
+        if(it == cache.end()) {
+            string symbol = "?";
+#ifdef LUAX_CPP_BACKTRACE
+            char** strings = backtrace_symbols(&addr, 1);
+            if(strings) {
+                symbol = LuaInterface::Demangle(strings[0]);
+                free(strings);
+            }
 #endif
-    // call error callback
-    //cerr << ss.str();
-    lua_getglobal(l, "__engine_ptr");
-    LuaInterface* lif = reinterpret_cast<LuaInterface*>(lua_touserdata(l, -1));
-    lua_pop(l, -1);
-    lif->error_cb(ss.str(), lif->error_cb_data);
+            it = cache.emplace(addr, move(symbol)).first;
+        }
+        if(frames.empty() || frames.back() != it->second) {
+            frames.push_back(it->second);
+        }
+    }
+    return frames;
+}
+
+
+const char*
+LuaError::what() const noexcept
+{
+    if(report.empty()) {
+        try {
+            stringstream ss;
+            ss << "LUA STACK\n=========\n" << LuaTraceback() << "\n\n";
+            if(!cpp_frames.empty()) {
+                ss << "C++ STACK\n=========";
+                for(auto const& s: CppTraceback()) {
+                    ss << "\n\033[1;32m.\033[0m " << s;
+                }
+            }
+            report = ss.str();
+        } catch(...) {
+            return message.c_str();
+        }
+    }
+    return report.c_str();
+}
+
+
+/*
+ * LuaInterface error management
+ */
+
+void
+LuaInterface::Error(string const& s) const
+{
+    tracer.Instant("error", s.c_str());
+    LuaError error = LuaError::Capture(L, s);
+    if(throw_errors) {
+        throw error;       // (in a C function, raised in Lua by TracedFunction)
+    }
+    error_cb(error, error_cb_data);
+}
+
+
+// a call failed with ThrowOnError, and its error message is at the top of the
+// stack: thrown (in a nested call, TracedFunction passes it on to the outer one)
+void
+LuaInterface::RaiseLastError() const
+{
+    lua_pop(L, 1);
+    unique_ptr<LuaError> e = move(last_error);
+    throw move(*e);
+}
+
+
+int
+LuaInterface::Traceback(lua_State* l)
+{
+    LuaInterface& lif = LuaInterface::get(l);
+    lif.debugger.Unwound(l);       // (no return hook runs for the frames unwound)
+    if(lif.raised) {
+        // thrown by a C function: it keeps the frames it was captured with, if the
+        // error is still the same one (and not caught by the script meanwhile)
+        if(lua_type(l, 1) == LUA_TSTRING && lif.raised->Message() == lua_tostring(l, 1)) {
+            lif.last_error = move(lif.raised);
+            return 1;
+        }
+        lif.raised.reset();
+    }
+    TraceScope trace(lif.tracer, "error", "Traceback");
+
+    string msg;
+    if(const char* s = lua_tostring(l, 1)) {
+        msg = s;
+    } else if(!lua_isnoneornil(l, 1) && luaL_callmeta(l, 1, "__tostring") && lua_isstring(l, -1)) {
+        msg = lua_tostring(l, -1);
+        lua_pop(l, 1);
+    } else {
+        msg = "(no error message)";
+    }
+
+    lif.last_error.reset(new LuaError(LuaError::Capture(l, msg)));
+    if(!lif.throw_errors && !lif.quiet_errors) {
+        lif.error_cb(*lif.last_error, lif.error_cb_data);
+    }
+
+    lua_pushstring(l, msg.c_str());
     return 1;
 }
 
 
-string 
+string
 LuaInterface::Demangle(string s)
 {
-#if defined(__GNUC__) && !defined(__MINGW32__) && defined(DEBUG)
-    regex e(".*\\((.+)(\\+.*)\\).*");
-    
-    smatch sm;
-    regex_match(s, sm, e, regex_constants::match_default);
-    if(sm.size() > 0) {
+    // backtrace_symbols format: "module(symbol+0xoffset) [0xaddress]"
+    size_t open = s.find('(');
+#ifdef LUAX_CPP_BACKTRACE
+    size_t plus = s.find('+', open);
+    if(open != string::npos && plus != string::npos && plus > open+1) {
         int status;
-        const char* c = string(sm[1]).c_str();
-        char* realname = abi::__cxa_demangle(c, nullptr, nullptr, &status);
+        char* realname = abi::__cxa_demangle(s.substr(open+1, plus-open-1).c_str(), nullptr, nullptr, &status);
         if(realname) {
-            // return demangled name
             string realn(realname);
             free(realname);
-            return regex_replace(s, e, realn);
-        } else {
-            regex e(R"(|(\.?\/.+?)\(.*\) \[.*\]|)");
-            return "\033[1;90m" + regex_replace(s, e, "$1") + "\033[0m";
+            return realn;
         }
-    } 
-    else 
-#endif
-    {
-        regex e(R"(|(\.?\/.+?)\(.*\) \[.*\]|)");
-        return "\033[1;90m" + regex_replace(s, e, "$1") + "\033[0m";
     }
+#endif
+    // not demangled: show only the module name
+    return "\033[1;90m" + (open != string::npos ? s.substr(0, open) : s) + "\033[0m";
 }
 
 
@@ -0,0 +1,242 @@
+#include "luaevents.h"
+
+extern "C" {
+    #include <lua.h>
+    #include <lauxlib.h>
+    #include <lualib.h>
+}
+
+#include <cassert>
+
+#include "luahelper.h"
+#include "luainterface.h"
+
+namespace lua {
+
+/*
+ * LuaInterface
+ */
+
+// calls each handler of `event` with the `nargs` values at the top of the
+// stack (marshalled once, and copied for each handler), and pops them
+void
+LuaInterface::DispatchEvent(const char* event, int nargs) const
+{
+    int s = StackSize() - nargs;
+    bool failed = false;
+    {
+        TraceScope trace(tracer, "event", event);
+        ++events.dispatched;
+
+        lua_rawgeti(L(), LUA_REGISTRYINDEX, events.handlers);
+        lua_getfield(L(), -1, event);
+        if(lua_istable(L(), -1)) {
+            int list = lua_gettop(L());
+            int n = static_cast<int>(lua_rawlen(L(), list));   // handlers subscribed during
+            lua_pushcfunction(L(), Traceback);                  // the dispatch are not called
+            int tb = lua_gettop(L());
+            for(int i=1; i<=n && !failed; ++i) {
+                lua_rawgeti(L(), list, i);
+                for(int a=1; a<=nargs; ++a) {
+                    lua_pushvalue(L(), s + a);
+                }
+                ++lua_depth;
+                int status = lua_pcall(L(), nargs, 0, tb);
+                --lua_depth;
+                if(status != LUA_OK) {
+                    if(throw_errors && last_error) {
+                        lua_replace(L(), s + 1);      // error message
+                        failed = true;
+                    } else {
+                        Pop();     // error message (already reported by Traceback)
+                    }
+                }
+            }
+        }
+    }
+    if(failed) {
+        lua_settop(L(), s + 1);
+        RaiseLastError();
+    }
+    lua_settop(L(), s);
+}
+
+
+// moves the `nargs` values at the top of the stack to the queue. A coalesced
+// event replaces the arguments of the same event already in the queue.
+void
+LuaInterface::QueueEvent(const char* event, int nargs, bool coalesce) const
+{
+    int s = StackSize() - nargs;
+
+    lua_rawgeti(L(), LUA_REGISTRYINDEX, events.queue[events.front]);
+    int q = lua_gettop(L());
+
+    int slot = 0;
+    if(coalesce) {
+        auto it = events.coalesced.find(event);
+        if(it != events.coalesced.end()) {
+            lua_rawgeti(L(), q, it->second + 1);
+            if(lua_tointeger(L(), -1) == nargs) {
+                slot = it->second;
+            } else {
+                lua_pushboolean(L(), false);      // skipped by the flush
+                lua_rawseti(L(), q, it->second);
+            }
+            Pop();
+        }
+    }
+    if(slot == 0) {
+        slot = events.used + 1;
+        lua_pushstring(L(), event);
+        lua_rawseti(L(), q, slot);
+        lua_pushinteger(L(), nargs);
+        lua_rawseti(L(), q, slot + 1);
+        events.used += 2 + nargs;
+        if(coalesce) {
+            events.coalesced[event] = slot;
+        }
+    }
+    for(int a=1; a<=nargs; ++a) {
+        lua_pushvalue(L(), s + a);
+        lua_rawseti(L(), q, slot + 1 + a);
+    }
+
+    lua_settop(L(), s);
+}
+
+
+// if a handler throws (ThrowOnError), the events left in the queue are dropped
+size_t
+LuaInterface::FlushEvents() const
+{
+    if(events.used == 0) {
+        return 0;
+    }
+    int s = StackSize();
+
+    // events posted by the handlers go to the other queue
+    int count = events.used;
+    int ref = events.queue[events.front];
+    lua_rawgeti(L(), LUA_REGISTRYINDEX, ref);
+    int q = lua_gettop(L());
+    events.front ^= 1;
+    events.used = 0;
+    events.coalesced.clear();
+
+    // the queue is reused: drop the references of the slots [from, to) of table `t`
+    auto clear = [&](int t, int from, int to) {
+        for(int j=from; j<to; ++j) {
+            lua_pushnil(L());
+            lua_rawseti(L(), t, j);
+        }
+    };
+
+    size_t n = 0;
+    int i = 1;
+    try {
+        while(i <= count) {
+            lua_rawgeti(L(), q, i);
+            lua_rawgeti(L(), q, i + 1);
+            int nargs = static_cast<int>(lua_tointeger(L(), -1));
+            Pop();
+            if(lua_type(L(), -1) == LUA_TSTRING) {
+                for(int a=1; a<=nargs; ++a) {
+                    lua_rawgeti(L(), q, i + 1 + a);
+                }
+                DispatchEvent(lua_tostring(L(), -1 - nargs), nargs);
+                ++n;
+            }
+            Pop();
+
+            clear(q, i, i + 2 + nargs);
+            i += 2 + nargs;
+        }
+    } catch(...) {
+        lua_settop(L(), s);
+        lua_rawgeti(L(), LUA_REGISTRYINDEX, ref);
+        clear(lua_gettop(L()), i, count + 1);
+        Pop();
+        throw;
+    }
+    Pop();
+
+    assert(StackSize() == s);
+    return n;
+}
+
+
+void initialize_events(LuaInterface const& luax)
+{
+    lua_State* L = luax.L();
+    EventBus& events = luax.events;
+
+    lua_newtable(L);
+    events.handlers = luaL_ref(L, LUA_REGISTRYINDEX);
+    for(int& q: events.queue) {
+        lua_newtable(L);
+        q = luaL_ref(L, LUA_REGISTRYINDEX);
+    }
+
+    // subscribe(event, f): call `f(...)` for each `event` emitted by the host; returns `f`
+    luax.RegisterFunction("subscribe", [](lua_State* L) {
+        luaL_checkstring(L, 1);
+        luaL_checktype(L, 2, LUA_TFUNCTION);
+        lua_rawgeti(L, LUA_REGISTRYINDEX, LuaInterface::get(L).events.handlers);
+        lua_pushvalue(L, 1);
+        lua_rawget(L, -2);
+        if(lua_isnil(L, -1)) {
+            lua_pop(L, 1);
+            lua_newtable(L);
+            lua_pushvalue(L, 1);
+            lua_pushvalue(L, -2);
+            lua_rawset(L, -4);
+        }
+        lua_pushvalue(L, 2);
+        lua_rawseti(L, -2, static_cast<int>(lua_rawlen(L, -2)) + 1);
+        lua_pushvalue(L, 2);
+        return 1;
+    });
+
+    // unsubscribe(event, f) -> whether `f` was subscribed. The list is copied, so
+    // that a dispatch in progress is not affected.
+    luax.RegisterFunction("unsubscribe", [](lua_State* L) {
+        luaL_checkstring(L, 1);
+        lua_rawgeti(L, LUA_REGISTRYINDEX, LuaInterface::get(L).events.handlers);
+        int all = lua_gettop(L);
+        lua_pushvalue(L, 1);
+        lua_rawget(L, all);
+        if(!lua_istable(L, -1)) {
+            lua_pushboolean(L, false);
+            return 1;
+        }
+        int list = lua_gettop(L);
+        int n = static_cast<int>(lua_rawlen(L, list));
+        lua_createtable(L, n, 0);
+        int m = 0;
+        bool found = false;
+        for(int i=1; i<=n; ++i) {
+            lua_rawgeti(L, list, i);
+            if(!found && lua_rawequal(L, -1, 2)) {
+                found = true;
+                lua_pop(L, 1);
+            } else {
+                lua_rawseti(L, -2, ++m);
+            }
+        }
+        lua_pushvalue(L, 1);
+        if(m == 0) {
+            lua_pushnil(L);
+        } else {
+            lua_pushvalue(L, -2);
+        }
+        lua_rawset(L, all);
+        lua_pushboolean(L, found);
+        return 1;
+    });
+}
+
+
+}  // namespace lua
+
+// vim: ts=4:sw=4:sts=4:expandtab
@@ -0,0 +1,32 @@
+#ifndef LUA_LUAEVENTS_H_
+#define LUA_LUAEVENTS_H_
+
+extern "C" {
+    #include <lua.h>
+    #include <lauxlib.h>
+}
+
+#include <string>
+#include <unordered_map>
+using namespace std;
+
+namespace lua {
+
+// handlers subscribed from Lua, by event name: a table of arrays of functions,
+// held in the registry. Queued events are kept flat in a Lua table, as
+// { event, nargs, args... } one after the other; there are two queues, so that
+// events posted by the handlers wait for the next flush.
+struct EventBus {
+    int    handlers = LUA_NOREF;             // (not initialized)
+    int    queue[2] = { LUA_NOREF, LUA_NOREF };
+    int    front = 0;                        // queue receiving the events
+    int    used = 0;                         // slots used in it
+    size_t dispatched = 0;                   // events delivered (emitted or flushed)
+    unordered_map<string, int> coalesced;    // event -> slot of its queued entry
+};
+
+}  // namespace lua
+
+#endif  // LUA_LUAEVENTS_H_
+
+// vim: ts=4:sw=4:sts=4:expandtab
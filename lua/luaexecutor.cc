@@ -0,0 +1,82 @@
+#include "luaexecutor.h"
+
+#include "luainterface.h"
+
+namespace lua {
+
+/*
+ * command queue
+ */
+
+CommandQueue::CommandQueue()
+    : head(new Node()), tail(head.load())
+{
+}
+
+
+CommandQueue::~CommandQueue()
+{
+    while(tail) {
+        Node* next = tail->next.load(memory_order_relaxed);
+        delete tail;
+        tail = next;
+    }
+}
+
+
+void
+CommandQueue::Push(function<void()> f)
+{
+    Node* node = new Node();
+    node->f = move(f);
+    Node* prev = head.exchange(node, memory_order_acq_rel);
+    prev->next.store(node, memory_order_release);
+}
+
+
+// false if empty, or if the next producer has not linked its node yet
+bool
+CommandQueue::Pop(function<void()>& f)
+{
+    Node* next = tail->next.load(memory_order_acquire);
+    if(!next) {
+        return false;
+    }
+    f = move(next->f);
+    delete tail;
+    tail = next;
+    return true;
+}
+
+
+/*
+ * LuaInterface
+ */
+
+// on the owner thread: runs up to `max` submitted commands, in order
+size_t
+LuaInterface::RunSubmitted(size_t max) const
+{
+    size_t n = 0;
+    function<void()> f;
+    while(n < max && commands.Pop(f)) {
+        int s = StackSize();
+        f();
+        f = nullptr;
+        lua_settop(L(), s);     // (results of void calls, error messages)
+        ++n;
+    }
+    return n;
+}
+
+
+void
+LuaInterface::SetOwnerThread()
+{
+    owner = this_thread::get_id();
+}
+
+
+}  // namespace lua
+
+// vim: ts=4:sw=4:sts=4:expandtab
@@ -0,0 +1,38 @@
+#ifndef LUA_LUAEXECUTOR_H_
+#define LUA_LUAEXECUTOR_H_
+
+#include <atomic>
+#include <functional>
+using namespace std;
+
+namespace lua {
+
+// lock-free queue of commands, with many producers and one consumer (Vyukov's
+// MPSC queue): a producer only exchanges the head and links the previous
+// node, and the consumer follows the links from its own end. (in luaexecutor.cc)
+class CommandQueue {
+public:
+    CommandQueue();
+    ~CommandQueue();
+
+    void Push(function<void()> f);          // any thread
+    bool Pop(function<void()>& f);          // the consumer only
+
+private:
+    struct Node {
+        atomic<Node*>    next { nullptr };
+        function<void()> f;
+    };
+
+    atomic<Node*> head;      // last pushed
+    Node*         tail;      // already consumed; its `next` is the next command
+
+    CommandQueue(CommandQueue const&) = delete;
+    CommandQueue& operator=(CommandQueue const&) = delete;
+};
+
+}  // namespace lua
+
+#endif  // LUA_LUAEXECUTOR_H_
+
+// vim: ts=4:sw=4:sts=4:expandtab
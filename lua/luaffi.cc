@@ -0,0 +1,109 @@
+#include "luahelper.h"
+
+#include "luainterface.h"
+
+#include <cstring>
+
+/*
+ * LuaJIT FFI fast paths. Scripts can build points and arrays of doubles as
+ * cdata (`ffi_point(x, y)`, `ffi_doubles(n)`), which the interface reads with
+ * a single copy instead of a table walk and one attribute lookup per field.
+ * Tables keep working as before. Without LuaJIT this is empty.
+ */
+
+namespace lua {
+
+#ifdef LUAX_LUAJIT
+
+static_assert(sizeof(Point) == 2 * sizeof(double) && is_trivially_copyable<Point>::value,
+        "the FFI fast path expects Point to be two doubles");
+
+static const char* ffi_setup = R"(
+    local ffi = require 'ffi'
+    ffi.cdef 'typedef struct { double x, y; } luax_point;'
+    local point, doubles = ffi.typeof('luax_point'), ffi.typeof('double[?]')
+    local istype, sizeof = ffi.istype, ffi.sizeof
+    -- 1 for a point, 2 and the number of elements for an array of doubles, or
+    -- nil (see FfiKind)
+    local function classify(v)
+        if istype(point, v) then return 1 end
+        if istype(doubles, v) then return 2, sizeof(v) / 8 end
+    end
+    return classify, point, doubles
+)";
+
+enum FfiKind { NOT_FFI = 0, FFI_POINT = 1, FFI_DOUBLES = 2 };
+
+// the kind of cdata at `i` (see `classify`), and the number of elements of an
+// array in `n`
+static FfiKind
+classify(lua_State* L, int i, size_t& n)
+{
+    if(lua_type(L, i) != LUA_TCDATA) {
+        return NOT_FFI;
+    }
+    i = lua_absindex(L, i);
+    lua_getfield(L, LUA_REGISTRYINDEX, "luax.ffi.classify");
+    lua_pushvalue(L, i);
+    lua_call(L, 1, 2);
+    auto kind = static_cast<FfiKind>(lua_tointeger(L, -2));    // (nil: 0)
+    if(kind == FFI_DOUBLES) {
+        n = static_cast<size_t>(lua_tonumber(L, -1));
+    }
+    lua_pop(L, 2);
+    return kind;
+}
+
+
+bool
+LuaInterface::FfiGet(int i, Point& p) const
+{
+    size_t n;
+    if(classify(L(), i, n) != FFI_POINT) {
+        return false;
+    }
+    memcpy(&p, lua_topointer(L(), i), sizeof p);
+    return true;
+}
+
+
+bool
+LuaInterface::FfiGet(int i, vector<double>& v) const
+{
+    size_t n = 0;
+    if(classify(L(), i, n) != FFI_DOUBLES) {
+        return false;
+    }
+    v.resize(n);
+    if(n > 0) {
+        memcpy(v.data(), lua_topointer(L(), i), n * sizeof(double));
+    }
+    return true;
+}
+
+
+void initialize_ffi(LuaInterface const& luax)
+{
+    lua_State* L = luax.L();
+
+    if(luaL_loadstring(L, ffi_setup) != LUA_OK) {
+        luax.Error(string("FFI setup: ") + lua_tostring(L, -1));
+        return;
+    }
+    lua_call(L, 0, 3);
+    lua_setglobal(L, "ffi_doubles");
+    lua_setglobal(L, "ffi_point");
+    lua_setfield(L, LUA_REGISTRYINDEX, "luax.ffi.classify");
+}
+
+#else
+
+bool LuaInterface::FfiGet(int, Point&) const { return false; }
+bool LuaInterface::FfiGet(int, vector<double>&) const { return false; }
+void initialize_ffi(LuaInterface const&) {}
+
+#endif
+
+}  // namespace lua
+
+// vim: ts=4:sw=4:sts=4:expandtab
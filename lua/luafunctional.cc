@@ -0,0 +1,456 @@
+#include "luahelper.h"
+
+#include "luainterface.h"
+
+#include <new>
+
+/*
+ * Native versions of the collection helpers of mylib/functional.lua. They
+ * keep the Lua semantics (arrays are walked like `ipairs`, results skip nil
+ * values), but presize the results and use raw access.
+ *
+ * Also lazy streams: `stream(t):filter(f):map(g):take(n):collect()`. The
+ * stages are only recorded; the terminal operation (collect, sum, count,
+ * first, each) runs all of them in a single pass over `t`, without
+ * intermediate tables, and stops as soon as a `take` is satisfied.
+ */
+
+namespace lua {
+
+namespace {
+
+// lua_rawgeti, returning the type of the value pushed
+int
+rawgeti(lua_State* L, int t, lua_Integer i)
+{
+    lua_rawgeti(L, t, i);
+    return lua_type(L, -1);
+}
+
+
+// call the function at `f` with the value on the top of the stack (popped), leaving the result
+void
+call1(lua_State* L, int f)
+{
+    lua_pushvalue(L, f);
+    lua_insert(L, -2);
+    lua_call(L, 1, 1);
+}
+
+
+// filter(table, func)
+int
+filter(lua_State* L)
+{
+    luaL_checktype(L, 1, LUA_TTABLE);
+    lua_createtable(L, static_cast<int>(lua_rawlen(L, 1)), 0);
+    int n = 0;
+    for(lua_Integer i=1; rawgeti(L, 1, i) != LUA_TNIL; ++i) {   // new v
+        lua_pushvalue(L, -1);
+        call1(L, 2);                                                 // new v ok
+        if(lua_toboolean(L, -1)) {
+            lua_pop(L, 1);
+            lua_rawseti(L, -2, ++n);
+        } else {
+            lua_pop(L, 2);
+        }
+    }
+    lua_pop(L, 1);
+    return 1;
+}
+
+
+// filter_tbl(table, func)
+int
+filter_tbl(lua_State* L)
+{
+    luaL_checktype(L, 1, LUA_TTABLE);
+    lua_newtable(L);                                // new
+    lua_pushnil(L);
+    while(lua_next(L, 1)) {                         // new k v
+        lua_pushvalue(L, 2);
+        lua_pushvalue(L, -3);
+        lua_pushvalue(L, -3);
+        lua_call(L, 2, 1);                          // new k v ok
+        if(lua_toboolean(L, -1)) {
+            lua_pop(L, 1);
+            lua_pushvalue(L, -2);
+            lua_insert(L, -2);                      // new k k v
+            lua_rawset(L, -4);
+        } else {
+            lua_pop(L, 2);
+        }
+    }
+    return 1;
+}
+
+
+// map(table, func)
+int
+map(lua_State* L)
+{
+    luaL_checktype(L, 1, LUA_TTABLE);
+    lua_createtable(L, static_cast<int>(lua_rawlen(L, 1)), 0);
+    int n = 0;
+    for(lua_Integer i=1; rawgeti(L, 1, i) != LUA_TNIL; ++i) {   // new v
+        call1(L, 2);                                                 // new r
+        if(lua_isnil(L, -1)) {
+            lua_pop(L, 1);
+        } else {
+            lua_rawseti(L, -2, ++n);
+        }
+    }
+    lua_pop(L, 1);
+    return 1;
+}
+
+
+// map_tbl(table, func)
+int
+map_tbl(lua_State* L)
+{
+    luaL_checktype(L, 1, LUA_TTABLE);
+    lua_newtable(L);                                // new
+    int n = 0;
+    lua_pushnil(L);
+    while(lua_next(L, 1)) {                         // new k v
+        lua_pushvalue(L, 2);
+        lua_pushvalue(L, -3);
+        lua_pushvalue(L, -3);
+        lua_call(L, 2, 1);                          // new k v r
+        if(lua_isnil(L, -1)) {
+            lua_pop(L, 2);
+        } else {
+            lua_rawseti(L, -4, ++n);
+            lua_pop(L, 1);
+        }
+    }
+    return 1;
+}
+
+
+// partition(table, func)
+int
+partition(lua_State* L)
+{
+    luaL_checktype(L, 1, LUA_TTABLE);
+    int len = static_cast<int>(lua_rawlen(L, 1));
+    lua_createtable(L, len, 0);                     // true_tbl
+    lua_createtable(L, len, 0);                     // true_tbl false_tbl
+    int nt = 0, nf = 0;
+    for(lua_Integer i=1; rawgeti(L, 1, i) != LUA_TNIL; ++i) {
+        lua_pushvalue(L, -1);
+        call1(L, 2);                                // true_tbl false_tbl v ok
+        if(lua_toboolean(L, -1)) {
+            lua_pop(L, 1);
+            lua_rawseti(L, -3, ++nt);
+        } else {
+            lua_pop(L, 1);
+            lua_rawseti(L, -2, ++nf);
+        }
+    }
+    lua_pop(L, 1);
+    return 2;
+}
+
+
+// append the flattened value at `v` to the table at `out`. Past MAX_DEPTH
+// levels (a table that contains itself, or nested too deeply for the C stack)
+// a Lua error is raised.
+void
+flatten_into(lua_State* L, int v, int out, int& n, int depth=0)
+{
+    static const int MAX_DEPTH = 100;
+
+    if(lua_istable(L, v)) {
+        lua_getfield(L, v, "is_a");                 // objects are not flattened
+        bool object = !lua_isnil(L, -1);
+        lua_pop(L, 1);
+        if(!object) {
+            if(depth == MAX_DEPTH) {
+                luaL_error(L, "flatten: tables nested more than %d levels (or a cycle)", MAX_DEPTH);
+            }
+            luaL_checkstack(L, 2, "table too deep to flatten");
+            for(lua_Integer i=1; rawgeti(L, v, i) != LUA_TNIL; ++i) {
+                flatten_into(L, lua_gettop(L), out, n, depth+1);
+                lua_pop(L, 1);
+            }
+            lua_pop(L, 1);
+            return;
+        }
+    }
+    lua_pushvalue(L, v);
+    lua_rawseti(L, out, ++n);
+}
+
+
+// flatten(list)
+int
+flatten(lua_State* L)
+{
+    lua_settop(L, 1);
+    lua_createtable(L, lua_istable(L, 1) ? static_cast<int>(lua_rawlen(L, 1)) : 1, 0);
+    int n = 0;
+    flatten_into(L, 1, 2, n);
+    return 1;
+}
+
+
+// compact(table)
+int
+compact(lua_State* L)
+{
+    luaL_checktype(L, 1, LUA_TTABLE);
+    lua_createtable(L, static_cast<int>(lua_rawlen(L, 1)), 0);
+    for(lua_Integer i=1; rawgeti(L, 1, i) != LUA_TNIL; ++i) {
+        lua_rawseti(L, -2, i);
+    }
+    lua_pop(L, 1);
+    return 1;
+}
+
+
+
+/*
+ * streams
+ */
+
+struct Stream {
+    enum Kind { FILTER, MAP, TAKE };
+    struct Stage {
+        Kind        kind;
+        lua_Integer n;         // take
+        lua_Integer taken;
+    };
+    vector<Stage> stages;      // stage functions are in the uservalue, at the stage number;
+                               // the source table is at 0
+};
+
+
+Stream*
+check_stream(lua_State* L)
+{
+    return reinterpret_cast<Stream*>(luaL_checkudata(L, 1, "luax.stream"));
+}
+
+
+// stream(t)
+int
+stream(lua_State* L)
+{
+    luaL_checktype(L, 1, LUA_TTABLE);
+    new(lua_newuserdata(L, sizeof(Stream))) Stream();
+    luaL_setmetatable(L, "luax.stream");
+    lua_createtable(L, 4, 1);
+    lua_pushvalue(L, 1);
+    lua_rawseti(L, -2, 0);
+    lua_setuservalue(L, -2);
+    return 1;
+}
+
+
+// stream:filter(f), stream:map(f), stream:take(n): a new stream, with the stages
+// of the receiver and the new one (so that streams can be branched)
+int
+add_stage(lua_State* L, Stream::Kind kind)
+{
+    Stream* s = check_stream(L);
+    Stream::Stage stage = { kind, 0, 0 };
+    if(kind == Stream::TAKE) {
+        stage.n = luaL_checkinteger(L, 2);
+    } else {
+        luaL_checktype(L, 2, LUA_TFUNCTION);
+    }
+    lua_settop(L, 2);
+
+    size_t n = s->stages.size();
+    Stream* ns = new(lua_newuserdata(L, sizeof(Stream))) Stream();
+    luaL_setmetatable(L, "luax.stream");
+    ns->stages.reserve(n + 1);
+    ns->stages = s->stages;
+    ns->stages.push_back(stage);
+
+    lua_createtable(L, static_cast<int>(n + 1), 1);      // stream f new uv
+    lua_getuservalue(L, 1);
+    for(lua_Integer i=0; i <= static_cast<lua_Integer>(n); ++i) {
+        lua_rawgeti(L, -1, i);
+        lua_rawseti(L, -3, i);
+    }
+    lua_pop(L, 1);
+    if(kind != Stream::TAKE) {
+        lua_pushvalue(L, 2);
+        lua_rawseti(L, -2, static_cast<lua_Integer>(n + 1));
+    }
+    lua_setuservalue(L, -2);
+    return 1;
+}
+
+
+// run all stages, calling `emit` for each value that gets through (value on the top of
+// the stack); `emit` returns false to stop
+template<typename F> void
+run(lua_State* L, Stream* s, F emit)
+{
+    lua_getuservalue(L, 1);
+    int uv = lua_gettop(L);
+    lua_rawgeti(L, uv, 0);
+    int src = lua_gettop(L);
+
+    for(auto& st: s->stages) {
+        st.taken = 0;
+        if(st.kind == Stream::TAKE && st.n <= 0) {
+            lua_settop(L, uv-1);
+            return;
+        }
+    }
+
+    bool done = false;
+    for(lua_Integer i=1; !done && rawgeti(L, src, i) != LUA_TNIL; ++i) {
+        bool keep = true;
+        for(size_t j=0; j < s->stages.size() && keep; ++j) {
+            Stream::Stage& st = s->stages[j];
+            switch(st.kind) {
+                case Stream::FILTER:
+                    lua_rawgeti(L, uv, static_cast<lua_Integer>(j+1));
+                    lua_pushvalue(L, -2);
+                    lua_call(L, 1, 1);
+                    keep = lua_toboolean(L, -1);
+                    lua_pop(L, 1);
+                    break;
+                case Stream::MAP:
+                    lua_rawgeti(L, uv, static_cast<lua_Integer>(j+1));
+                    lua_insert(L, -2);
+                    lua_call(L, 1, 1);
+                    keep = !lua_isnil(L, -1);
+                    break;
+                case Stream::TAKE:
+                    done = (++st.taken >= st.n);
+                    break;
+            }
+        }
+        if(keep && !emit()) {
+            done = true;
+        }
+        lua_settop(L, src);
+    }
+    lua_settop(L, uv-1);
+}
+
+
+int
+stream_collect(lua_State* L)
+{
+    Stream* s = check_stream(L);
+    lua_settop(L, 1);
+    lua_newtable(L);
+    lua_Integer n = 0;
+    run(L, s, [&]() {
+        lua_pushvalue(L, -1);
+        lua_rawseti(L, 2, ++n);
+        return true;
+    });
+    return 1;
+}
+
+
+int
+stream_sum(lua_State* L)
+{
+    Stream* s = check_stream(L);
+    lua_settop(L, 1);
+    lua_pushinteger(L, 0);                          // accumulator (0 for an empty stream)
+    run(L, s, [&]() {
+        lua_pushvalue(L, 2);
+        lua_pushvalue(L, -2);
+        lua_arith(L, LUA_OPADD);
+        lua_replace(L, 2);
+        return true;
+    });
+    return 1;
+}
+
+
+int
+stream_count(lua_State* L)
+{
+    Stream* s = check_stream(L);
+    lua_settop(L, 1);
+    lua_Integer n = 0;
+    run(L, s, [&]() { ++n; return true; });
+    lua_pushinteger(L, n);
+    return 1;
+}
+
+
+int
+stream_first(lua_State* L)
+{
+    Stream* s = check_stream(L);
+    lua_settop(L, 1);
+    lua_pushnil(L);
+    run(L, s, [&]() {
+        lua_pushvalue(L, -1);
+        lua_replace(L, 2);
+        return false;
+    });
+    return 1;
+}
+
+
+int
+stream_each(lua_State* L)
+{
+    Stream* s = check_stream(L);
+    luaL_checktype(L, 2, LUA_TFUNCTION);
+    lua_settop(L, 2);
+    run(L, s, [&]() {
+        lua_pushvalue(L, 2);
+        lua_pushvalue(L, -2);
+        lua_call(L, 1, 0);
+        return true;
+    });
+    return 0;
+}
+
+}  // anonymous namespace
+
+
+void initialize_functional(LuaInterface const& luax)
+{
+    luax.RegisterFunction("filter", filter);
+    luax.RegisterFunction("filter_tbl", filter_tbl);
+    luax.RegisterFunction("map", map);
+    luax.RegisterFunction("map_tbl", map_tbl);
+    luax.RegisterFunction("partition", partition);
+    luax.RegisterFunction("flatten", flatten);
+    luax.RegisterFunction("compact", compact);
+
+    // streams
+    lua_State* L = luax.L();
+    static const luaL_Reg stream_methods[] = {
+        { "filter",  [](lua_State* L) { return add_stage(L, Stream::FILTER); } },
+        { "map",     [](lua_State* L) { return add_stage(L, Stream::MAP); } },
+        { "take",    [](lua_State* L) { return add_stage(L, Stream::TAKE); } },
+        { "collect", stream_collect },
+        { "sum",     stream_sum },
+        { "count",   stream_count },
+        { "first",   stream_first },
+        { "each",    stream_each },
+        { nullptr,   nullptr },
+    };
+    luaL_newmetatable(L, "luax.stream");
+    luaL_newlib(L, stream_methods);
+    lua_setfield(L, -2, "__index");
+    lua_pushcfunction(L, [](lua_State* L) {
+        reinterpret_cast<Stream*>(lua_touserdata(L, 1))->~Stream();
+        return 0;
+    });
+    lua_setfield(L, -2, "__gc");
+    lua_pop(L, 1);
+    luax.RegisterFunction("stream", stream);
+}
+
+
+}  // namespace lua
+
+// vim: ts=4:sw=4:sts=4:expandtab
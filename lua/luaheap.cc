@@ -0,0 +1,327 @@
+#include "luaheap.h"
+
+extern "C" {
+    #include <lua.h>
+    #include <lauxlib.h>
+    #include <lualib.h>
+}
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+
+#include "luainterface.h"
+
+namespace lua {
+
+/*
+ * heap profiler
+ */
+
+void
+HeapProfiler::Enable(lua_State* L, size_t sample_bytes)
+{
+    Disable(L);
+    this->L = L;
+    original = lua_getallocf(L, &original_ud);
+    rate = countdown = max<int64_t>(1, static_cast<int64_t>(sample_bytes));
+
+    // the C functions that run a coroutine (see Resumed)
+    resume = wrapped = nullptr;
+    lua_getglobal(L, "coroutine");
+    if(lua_istable(L, -1)) {
+        lua_getfield(L, -1, "resume");
+        resume = lua_tocfunction(L, -1);
+        lua_getfield(L, -2, "wrap");
+        if(lua_isfunction(L, -1)) {
+            lua_pushcfunction(L, [](lua_State*) { return 0; });
+            if(lua_pcall(L, 1, 1, 0) == LUA_OK) {
+                wrapped = lua_tocfunction(L, -1);
+            }
+        }
+        lua_pop(L, 2);
+    }
+    lua_pop(L, 1);
+
+    totals = HeapSnapshot();
+    totals.in_use = totals.peak = lua_gc(L, LUA_GCCOUNT, 0) * 1024 + lua_gc(L, LUA_GCCOUNTB, 0);
+    sites.clear();
+    blocks.clear();
+    lua_setallocf(L, Allocate, this);
+}
+
+
+void
+HeapProfiler::Disable(lua_State* L)
+{
+    if(original) {
+        lua_setallocf(L, original, original_ud);
+        original = nullptr;
+        blocks.clear();      // frees are not seen anymore
+        for(auto& s: sites) {
+            s.second.live = 0;
+        }
+    }
+}
+
+
+// called by Lua instead of its allocator
+void*
+HeapProfiler::Allocate(void* ud, void* ptr, size_t osize, size_t nsize)
+{
+    HeapProfiler* h = reinterpret_cast<HeapProfiler*>(ud);
+    size_t old = ptr ? osize : 0;     // (without a block, osize is the type of object)
+
+    // the site is taken before the block moves: a Lua stack being grown is still valid
+    HeapSite* site = nullptr;
+    if(nsize > old) {
+        h->countdown -= static_cast<int64_t>(nsize - old);
+        if(h->countdown <= 0) {
+            h->countdown = h->rate;
+            site = h->Sample();
+        }
+    }
+
+    void* r = h->original(h->original_ud, ptr, osize, nsize);
+    if(nsize > 0 && !r) {
+        return r;            // failed, the block is unchanged
+    }
+
+    h->totals.in_use += nsize - old;
+    h->totals.peak = max(h->totals.peak, h->totals.in_use);
+    if(!ptr) {
+        ++h->totals.allocations;
+    } else if(nsize == 0) {
+        ++h->totals.frees;
+    }
+
+    Block* block = nullptr;
+    if(ptr && !h->blocks.empty()) {
+        auto it = h->blocks.find(ptr);
+        if(it != h->blocks.end()) {
+            Block b = it->second;
+            h->blocks.erase(it);
+            if(nsize > 0) {
+                block = h->Track(r, b);
+            }
+            if(!block) {
+                b.site->live -= b.weight;
+            }
+        }
+    }
+
+    if(site) {
+        uint64_t weight = max<uint64_t>(nsize - old, h->rate);
+        ++site->samples;
+        site->allocated += weight;
+        if(block) {          // grown: still retained by the site that allocated it
+            block->site->live += weight;
+            block->weight += weight;
+        } else if(h->Track(r, { site, weight })) {
+            site->live += weight;
+        }
+    }
+    return r;
+}
+
+
+// follow a sampled block; without memory, it is left out of the live bytes (no
+// exception may cross the Lua allocator)
+HeapProfiler::Block*
+HeapProfiler::Track(void* ptr, Block b)
+{
+    try {
+        return &(blocks[ptr] = b);
+    } catch(bad_alloc const&) {
+        return nullptr;
+    }
+}
+
+
+// the coroutine run by the innermost function of `T`, if it is coroutine.resume
+// (its first argument) or a function of coroutine.wrap (its first upvalue).
+// When that function is a C function, it is pushed on `T` for a moment (within
+// the stack space a C function is given).
+lua_State*
+HeapProfiler::Resumed(lua_State* T)
+{
+    lua_Debug ar;
+    if(!lua_getstack(T, 0, &ar) || !lua_getinfo(T, "S", &ar) || ar.what[0] != 'C') {
+        return nullptr;
+    }
+    lua_getinfo(T, "f", &ar);
+    CFunction f = lua_tocfunction(T, -1);
+    lua_State* co = nullptr;
+    if(f && f == resume && lua_getlocal(T, &ar, 1)) {
+        co = lua_tothread(T, -1);
+        lua_pop(T, 1);
+    } else if(f && f == wrapped && lua_getupvalue(T, -1, 1)) {
+        co = lua_tothread(T, -1);
+        lua_pop(T, 1);
+    }
+    lua_pop(T, 1);
+    return co != T ? co : nullptr;
+}
+
+
+// the innermost line of Lua code running, from the running coroutine out to the
+// main thread (the debug API used doesn't allocate). nullptr if the site can't
+// be added.
+HeapSite*
+HeapProfiler::Sample()
+{
+    const int MAX_THREADS = 16;
+    lua_State* threads[MAX_THREADS] = { L };
+    int n = 1;
+    while(n < MAX_THREADS && (threads[n] = Resumed(threads[n - 1])) != nullptr) {
+        ++n;
+    }
+
+    char where[LUA_IDSIZE + 16] = "(no Lua code)";
+    lua_Debug ar;
+    bool found = false;
+    for(int t=n-1; t>=0 && !found; --t) {
+        for(int level=0; lua_getstack(threads[t], level, &ar); ++level) {
+            lua_getinfo(threads[t], "Sl", &ar);
+            if(ar.currentline > 0) {
+                snprintf(where, sizeof where, "%s:%d", ar.short_src, ar.currentline);
+                found = true;
+                break;
+            }
+        }
+    }
+
+    try {
+        HeapSite& site = sites[where];
+        if(site.where.empty()) {
+            site.where = where;
+        }
+        return &site;
+    } catch(bad_alloc const&) {
+        return nullptr;      // (the sample is skipped)
+    }
+}
+
+
+HeapSnapshot
+HeapProfiler::Snapshot() const
+{
+    HeapSnapshot snapshot = totals;
+    snapshot.sites.reserve(sites.size());
+    for(auto const& s: sites) {
+        snapshot.sites.push_back(s.second);
+    }
+    return snapshot;
+}
+
+
+void
+HeapProfiler::Report(ostream& out, HeapSnapshot const& snapshot, size_t top)
+{
+    char line[256];
+    snprintf(line, sizeof line, "in use: %llu bytes (peak %llu), %llu allocations, %llu frees\n",
+            static_cast<unsigned long long>(snapshot.in_use), static_cast<unsigned long long>(snapshot.peak),
+            static_cast<unsigned long long>(snapshot.allocations), static_cast<unsigned long long>(snapshot.frees));
+    out << line;
+
+    vector<HeapSite> sites = snapshot.sites;
+    for(int retained=0; retained<2; ++retained) {
+        sort(begin(sites), end(sites), [retained](HeapSite const& a, HeapSite const& b) {
+            return retained ? a.live > b.live : a.allocated > b.allocated;
+        });
+        out << (retained ? "\ntop retained:\n" : "\ntop allocators:\n");
+        snprintf(line, sizeof line, "%14s %14s %8s  %s\n", "allocated", "live", "samples", "site");
+        out << line;
+        for(size_t i=0; i<sites.size() && i<top; ++i) {
+            if(retained && sites[i].live == 0) {
+                break;
+            }
+            snprintf(line, sizeof line, "%14llu %14llu %8zu  %s\n",
+                    static_cast<unsigned long long>(sites[i].allocated), static_cast<unsigned long long>(sites[i].live),
+                    sites[i].samples, sites[i].where.c_str());
+            out << line;
+        }
+    }
+}
+
+
+void
+HeapProfiler::Diff(ostream& out, HeapSnapshot const& before, HeapSnapshot const& after, size_t top)
+{
+    struct Delta {
+        string  where;
+        int64_t allocated, live;
+    };
+    unordered_map<string, HeapSite const*> old;
+    for(auto const& s: before.sites) {
+        old[s.where] = &s;
+    }
+    vector<Delta> deltas;
+    for(auto const& s: after.sites) {
+        auto it = old.find(s.where);
+        int64_t allocated = s.allocated - (it != old.end() ? it->second->allocated : 0),
+                live = s.live - (it != old.end() ? it->second->live : 0);
+        if(allocated != 0 || live != 0) {
+            deltas.push_back({ s.where, allocated, live });
+        }
+    }
+    sort(begin(deltas), end(deltas), [](Delta const& a, Delta const& b) {
+        return llabs(a.live) != llabs(b.live) ? llabs(a.live) > llabs(b.live) : a.allocated > b.allocated;
+    });
+
+    char line[256];
+    snprintf(line, sizeof line, "in use: %+lld bytes, %llu allocations, %llu frees\n",
+            static_cast<long long>(after.in_use - before.in_use),
+            static_cast<unsigned long long>(after.allocations - before.allocations),
+            static_cast<unsigned long long>(after.frees - before.frees));
+    out << line;
+    snprintf(line, sizeof line, "%14s %14s  %s\n", "allocated", "live", "site");
+    out << line;
+    for(size_t i=0; i<deltas.size() && i<top; ++i) {
+        snprintf(line, sizeof line, "%+14lld %+14lld  %s\n", static_cast<long long>(deltas[i].allocated),
+                static_cast<long long>(deltas[i].live), deltas[i].where.c_str());
+        out << line;
+    }
+}
+
+
+/*
+ * LuaInterface
+ */
+
+void
+LuaInterface::HeapProfile(bool enable, size_t sample_bytes) const
+{
+    if(enable) {
+        heap.Enable(L(), sample_bytes);
+    } else {
+        heap.Disable(L());
+    }
+}
+
+
+HeapSnapshot
+LuaInterface::TakeHeapSnapshot() const
+{
+    return heap.Snapshot();
+}
+
+
+void
+LuaInterface::HeapReport(ostream& out, size_t top) const
+{
+    HeapProfiler::Report(out, heap.Snapshot(), top);
+}
+
+
+void
+LuaInterface::HeapDiff(ostream& out, HeapSnapshot const& before, HeapSnapshot const& after, size_t top)
+{
+    HeapProfiler::Diff(out, before, after, top);
+}
+
+
+}  // namespace lua
+
+// vim: ts=4:sw=4:sts=4:expandtab
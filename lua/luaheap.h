@@ -0,0 +1,75 @@
+#ifndef LUA_LUAHEAP_H_
+#define LUA_LUAHEAP_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <ostream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+using namespace std;
+
+struct lua_State;
+
+namespace lua {
+
+// memory allocated from a line of a script (estimated from the samples)
+struct HeapSite {
+    string   where;              // "source:line"
+    size_t   samples = 0;
+    uint64_t allocated = 0;      // bytes
+    uint64_t live = 0;           // bytes not freed yet
+};
+
+struct HeapSnapshot {
+    uint64_t         in_use = 0;        // bytes, exact
+    uint64_t         peak = 0;
+    uint64_t         allocations = 0;
+    uint64_t         frees = 0;
+    vector<HeapSite> sites;
+};
+
+// heap profiler: wraps the allocator of the state, counts every allocation, and
+// samples one every `sample_bytes` allocated bytes. A sample is attributed to
+// the innermost Lua function of the running coroutine, and followed until the
+// block is freed. (in luaheap.cc)
+class HeapProfiler {
+public:
+    void Enable(lua_State* L, size_t sample_bytes);
+    void Disable(lua_State* L);
+    bool Enabled() const { return original != nullptr; }
+
+    HeapSnapshot Snapshot() const;
+    static void Report(ostream& out, HeapSnapshot const& snapshot, size_t top);
+    static void Diff(ostream& out, HeapSnapshot const& before, HeapSnapshot const& after, size_t top);
+
+private:
+    struct Block {
+        HeapSite* site;
+        uint64_t  weight;
+    };
+    typedef void* (*Alloc)(void*, void*, size_t, size_t);   // lua_Alloc
+    typedef int (*CFunction)(lua_State*);                    // lua_CFunction
+
+    static void* Allocate(void* ud, void* ptr, size_t osize, size_t nsize);
+    HeapSite* Sample();
+    lua_State* Resumed(lua_State* T);
+    Block* Track(void* ptr, Block b);
+
+    lua_State*                        L = nullptr;
+    Alloc                             original = nullptr;
+    void*                             original_ud = nullptr;
+    CFunction                         resume = nullptr;   // coroutine.resume
+    CFunction                         wrapped = nullptr;  // functions of coroutine.wrap
+    int64_t                           rate = 1;
+    int64_t                           countdown = 1;
+    HeapSnapshot                      totals;        // (without the sites)
+    unordered_map<string, HeapSite>   sites;
+    unordered_map<void*, Block>       blocks;        // sampled blocks
+};
+
+}  // namespace lua
+
+#endif  // LUA_LUAHEAP_H_
+
+// vim: ts=4:sw=4:sts=4:expandtab
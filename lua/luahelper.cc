@@ -1,7 +1,10 @@
-
 #include "luahelper.h"
 
 #include <cstdio>
+#include <cstring>
+#include <string>
+#include <utility>
+#include <vector>
 
 /*
 #ifdef DEBUG
@@ -14,10 +17,301 @@
 
 namespace lua {
 
+/*
+ * typecheck { name='type', other=Class, ... }
+ * tablecheck { tbl, key='type', other=Class, ... }
+ *
+ * Each spec is compiled once into a descriptor, kept in a table in the
+ * registry under the key of the spec (its names and values, length-prefixed,
+ * as a Lua string: the spec table itself is new on each call). The checks
+ * then run through the C API, and messages are only formatted when a check fails.
+ */
+
+namespace {
+
+struct TypeSpec {
+    int    local;     // local index in the caller (typecheck only; a hint, checked by name)
+    string name;
+    int    type;      // LUA_T*, or LUA_TNONE when the spec is a class (read from the spec table)
+};
+using Descriptor = vector<TypeSpec>;
+
+int spec_type(lua_State* L);
+
+
+// appends `len` bytes of `s`, prefixed by their length (so that the parts of
+// a key can't run into each other)
+void
+append_counted(string& key, char tag, const char* s, size_t len)
+{
+    char prefix[32];
+    snprintf(prefix, sizeof prefix, "%c%zu:", tag, len);
+    key += prefix;
+    key.append(s, len);
+}
+
+
+// pushes the key of the spec at index 1: its string keys and their values
+// (a type name, or the identity of a class table). The values are only
+// classified when the descriptor is built.
+void
+push_spec_key(lua_State* L)
+{
+    string key;
+    lua_pushnil(L);
+    while(lua_next(L, 1)) {
+        if(lua_type(L, -2) == LUA_TSTRING) {
+            size_t len;
+            const char* s = lua_tolstring(L, -2, &len);
+            append_counted(key, 'k', s, len);
+            if(lua_type(L, -1) == LUA_TSTRING) {
+                s = lua_tolstring(L, -1, &len);
+                append_counted(key, 's', s, len);
+            } else {
+                char value[32];
+                snprintf(value, sizeof value, "%c%p", 'a' + lua_type(L, -1) - LUA_TNONE, lua_topointer(L, -1));
+                key += value;
+            }
+        }
+        lua_pop(L, 1);
+    }
+    lua_pushlstring(L, key.data(), key.size());
+}
+
+
+// the descriptor of the spec at index 1; nullptr with the error message pushed
+Descriptor*
+find_descriptor(lua_State* L, const char* cache)
+{
+    push_spec_key(L);
+    lua_getfield(L, LUA_REGISTRYINDEX, cache);      // key cache
+    if(lua_isnil(L, -1)) {
+        lua_pop(L, 1);
+        lua_newtable(L);
+        lua_pushvalue(L, -1);
+        lua_setfield(L, LUA_REGISTRYINDEX, cache);
+    }
+    lua_pushvalue(L, -2);
+    lua_rawget(L, -2);                              // key cache descriptor
+    auto d = reinterpret_cast<Descriptor*>(lua_touserdata(L, -1));
+    if(!d) {
+        lua_pop(L, 1);
+        Descriptor specs;
+        lua_pushnil(L);
+        while(lua_next(L, 1)) {
+            if(lua_type(L, -2) == LUA_TSTRING) {
+                int type = spec_type(L);
+                if(type < LUA_TNONE) {
+                    string msg = "Invalid type definition " + LuaInterface::get(L).Inspect(-1);
+                    lua_pop(L, 4);
+                    luaL_where(L, 1);
+                    lua_pushstring(L, msg.c_str());
+                    lua_concat(L, 2);
+                    return nullptr;
+                }
+                specs.push_back({ 0, lua_tostring(L, -2), type });
+            }
+            lua_pop(L, 1);
+        }
+
+        d = new(lua_newuserdata(L, sizeof(Descriptor))) Descriptor(move(specs));
+        if(luaL_newmetatable(L, "typecheck.descriptor")) {
+            lua_pushcfunction(L, [](lua_State* L) {
+                reinterpret_cast<Descriptor*>(lua_touserdata(L, 1))->~Descriptor();
+                return 0;
+            });
+            lua_setfield(L, -2, "__gc");
+        }
+        lua_setmetatable(L, -2);
+        lua_pushvalue(L, -3);
+        lua_pushvalue(L, -2);
+        lua_rawset(L, -4);
+    }
+    lua_pop(L, 3);
+    return d;
+}
+
+
+// local of the caller at `ar` named as the spec (0: none)
+int
+find_local(lua_State* L, lua_Debug* ar, TypeSpec& spec)
+{
+    const char* name;
+    if(spec.local > 0 && (name = lua_getlocal(L, ar, spec.local))) {
+        lua_pop(L, 1);
+        if(spec.name == name) {
+            return spec.local;
+        }
+    }
+    for(int i=1; (name = lua_getlocal(L, ar, i)); ++i) {
+        lua_pop(L, 1);
+        if(spec.name == name) {
+            spec.local = i;
+            return i;
+        }
+    }
+    return 0;
+}
+
+
+// classify the spec value at the top of the stack
+int
+spec_type(lua_State* L)
+{
+    if(lua_type(L, -1) == LUA_TSTRING) {
+        const char* s = lua_tostring(L, -1);
+        for(int t=LUA_TNIL; t<=LUA_TTHREAD; ++t) {
+            if(strcmp(s, lua_typename(L, t)) == 0) {
+                return t;
+            }
+        }
+    } else if(lua_istable(L, -1)) {
+        lua_getfield(L, -1, "is_a");
+        bool klass = lua_istable(L, -1);
+        lua_pop(L, 1);
+        if(klass) {
+            return LUA_TNONE;
+        }
+    }
+    return LUA_TNIL - 100;   // invalid
+}
+
+
+// value at -1 matches the spec? (class specs are at -2)
+bool
+matches(lua_State* L, int type)
+{
+    if(type != LUA_TNONE) {
+        return lua_type(L, -1) == type;
+    }
+    if(!lua_istable(L, -1)) {
+        return false;
+    }
+    lua_getfield(L, -1, "is_a");
+    if(!lua_istable(L, -1)) {
+        lua_pop(L, 1);
+        return false;
+    }
+    lua_pushvalue(L, -3);
+    lua_rawget(L, -2);
+    bool ok = lua_toboolean(L, -1);
+    lua_pop(L, 2);
+    return ok;
+}
+
+
+// push "Type error: name=<value> (should be a <type>)"; value at -1, spec at -2
+void
+push_type_error(lua_State* L, string const& name, int type)
+{
+    string typedesc;
+    if(type == LUA_TNONE) {
+        lua_getfield(L, -2, "classname");
+        lua_pushvalue(L, -3);
+        lua_call(L, 1, 1);
+        typedesc = lua_isstring(L, -1) ? lua_tostring(L, -1) : "?";
+        lua_pop(L, 1);
+    } else {
+        typedesc = lua_typename(L, type);
+    }
+    string msg = "Type error: " + name + "=" + LuaInterface::get(L).Inspect(-1) + " (should be a " + typedesc + ")";
+    luaL_where(L, 1);
+    lua_pushstring(L, msg.c_str());
+    lua_concat(L, 2);
+}
+
+
+// returns false with the error message pushed
+bool
+typecheck(lua_State* L)
+{
+    lua_Debug ar;
+    if(!lua_istable(L, 1) || !lua_getstack(L, 1, &ar)) {
+        return true;
+    }
+
+    Descriptor* d = find_descriptor(L, "typecheck.cache");
+    if(!d) {
+        return false;
+    }
+
+    for(auto& spec: *d) {
+        int local = find_local(L, &ar, spec);
+        if(local == 0) {
+            continue;
+        }
+        if(spec.type == LUA_TNONE) {
+            lua_getfield(L, 1, spec.name.c_str());
+        }
+        lua_getlocal(L, &ar, local);
+        if(!matches(L, spec.type)) {
+            if(spec.type != LUA_TNONE) {
+                lua_getfield(L, 1, spec.name.c_str());
+                lua_insert(L, -2);
+            }
+            push_type_error(L, spec.name, spec.type);
+            return false;
+        }
+        lua_pop(L, spec.type == LUA_TNONE ? 2 : 1);
+    }
+    return true;
+}
+
+
+bool
+tablecheck(lua_State* L)
+{
+    lua_Debug ar;
+    if(!lua_istable(L, 1) || !lua_getstack(L, 1, &ar)) {
+        return true;
+    }
+
+    lua_rawgeti(L, 1, 1);                           // tbl
+    if(!lua_istable(L, -1)) {
+        string msg = "\"table\" should be a table, not " + LuaInterface::get(L).Inspect(-1);
+        lua_pushstring(L, msg.c_str());
+        return false;
+    }
+    int tbl = lua_gettop(L);
+
+    Descriptor* d = find_descriptor(L, "tablecheck.cache");
+    if(!d) {
+        return false;
+    }
+
+    for(auto const& spec: *d) {
+        lua_getfield(L, 1, spec.name.c_str());      // spec
+        lua_getfield(L, tbl, spec.name.c_str());    // spec value
+        if(lua_isnil(L, -1)) {
+            string msg = "Type error: key `" + spec.name + "` not found in table " + LuaInterface::get(L).Inspect(tbl);
+            lua_pushstring(L, msg.c_str());
+            return false;
+        }
+        if(!matches(L, spec.type)) {
+            push_type_error(L, spec.name, spec.type);
+            return false;
+        }
+        lua_pop(L, 2);
+    }
+    return true;
+}
+
+}  // anonymous namespace
+
 
 void initialize_helper_functions(LuaInterface const& luax)
 {
-    (void) luax;
+#ifdef DEBUG
+    luax.RegisterFunction("typecheck", [](lua_State* L) {
+        return typecheck(L) ? 0 : lua_error(L);
+    });
+    luax.RegisterFunction("tablecheck", [](lua_State* L) {
+        return tablecheck(L) ? 0 : lua_error(L);
+    });
+#else
+    luax.RegisterFunction("typecheck", [](lua_State*) { return 0; });
+    luax.RegisterFunction("tablecheck", [](lua_State*) { return 0; });
+#endif
 /*
 #ifdef DEBUG
     luax.RegisterFunction("readline", [](lua_State* L) {
@@ -7,6 +7,13 @@ namespace lua {
 class LuaInterface;
 
 void initialize_helper_functions(LuaInterface const& luax);
+void initialize_functional(LuaInterface const& luax);        // (in luafunctional.cc)
+void initialize_debugger(LuaInterface const& luax);          // (in luadebugger.cc)
+void initialize_modules(LuaInterface const& luax);           // (in luamodules.cc)
+void initialize_parallel(LuaInterface const& luax);          // (in luaparallel.cc)
+void initialize_ffi(LuaInterface const& luax);               // (in luaffi.cc)
+void initialize_pool(LuaInterface const& luax);              // (in luapool.cc)
+void initialize_events(LuaInterface const& luax);            // (in luaevents.cc)
 
 }  // namespace lua
 
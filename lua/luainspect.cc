@@ -0,0 +1,338 @@
+#include "luainterface.h"
+
+extern "C" {
+    #include <lua.h>
+    #include <lauxlib.h>
+    #include <lualib.h>
+}
+
+#include <cassert>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <ostream>
+#include <sstream>
+
+/*
+ * Native value inspector. It walks the value with the raw C API (no
+ * metamethods, no calls into Lua, no Lua-side allocations) and writes
+ * directly into a stream, stopping when any of the limits is reached.
+ *
+ * The format is the one of inspect.lua: `@` marks a table that is not an
+ * array and has no `class` field (not an instance), followed by the class
+ * name when the table has a `classname` method. Unlike inspect.lua, the
+ * name is found without calling `classname` (from `class_desc`, or the
+ * global holding the class), and `inspect` methods are not called.
+ */
+
+namespace lua {
+
+namespace {
+
+class Inspector {
+public:
+    Inspector(lua_State* L, ostream& os, InspectOptions const& opt)
+        : L(L), os(os), opt(opt) {}
+
+    void Value(int i, int depth);
+    bool Full() const { return full; }
+
+private:
+    void Write(const char* s, size_t len);
+    void Write(const char* s) { Write(s, strlen(s)); }
+    void Number(lua_Number n);
+    void String(int i);
+    void Table(int i, int depth);
+    void ClassName(int i);
+    bool Hidden(int key) const;
+    bool RawField(int i, const char* field);
+
+    lua_State* L;
+    ostream& os;
+    InspectOptions const& opt;
+    size_t written = 0;
+    bool full = false;
+    vector<const void*> visiting;
+};
+
+
+void
+Inspector::Write(const char* s, size_t len)
+{
+    if(full) {
+        return;
+    }
+    if(written + len > opt.max_bytes) {
+        // the "..." suffix counts in the limit
+        size_t room = opt.max_bytes - written,
+               keep = room > 3 ? room - 3 : 0;
+        os.write(s, keep);
+        os.write("...", room - keep);
+        written = opt.max_bytes;
+        full = true;
+        return;
+    }
+    os.write(s, len);
+    written += len;
+}
+
+
+void
+Inspector::Number(lua_Number n)
+{
+    char buf[64];
+    int len;
+    if(n == floor(n) && fabs(n) < 1e15) {
+        len = snprintf(buf, sizeof(buf), "%.0f", n);
+    } else {
+        len = snprintf(buf, sizeof(buf), "%.3f", n);
+    }
+    Write(buf, len);
+}
+
+
+void
+Inspector::String(int i)
+{
+    size_t len;
+    const char* s = lua_tolstring(L, i, &len);
+    Write("'", 1);
+    Write(s, len);
+    Write("'", 1);
+}
+
+
+bool
+Inspector::Hidden(int key) const
+{
+    if(lua_type(L, key) != LUA_TSTRING) {
+        return false;
+    }
+    static const char* hidden[] = { "class", "class_desc", "is_a", "__index", "_init", "classname" };
+    const char* k = lua_tostring(L, key);
+    for(const char* h: hidden) {
+        if(strcmp(k, h) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+
+// push t[field] of the table at `i`, without metamethods, or through the
+// `__index` table of its metatable (an instance and its class); false with
+// nothing pushed if it is nil
+bool
+Inspector::RawField(int i, const char* field)
+{
+    lua_pushstring(L, field);
+    lua_rawget(L, i);
+    if(!lua_isnil(L, -1)) {
+        return true;
+    }
+    lua_pop(L, 1);
+    if(lua_getmetatable(L, i)) {
+        lua_pushstring(L, "__index");
+        lua_rawget(L, -2);
+        if(lua_istable(L, -1)) {
+            lua_pushstring(L, field);
+            lua_rawget(L, -2);
+            if(!lua_isnil(L, -1)) {
+                lua_replace(L, -3);
+                lua_pop(L, 1);
+                return true;
+            }
+            lua_pop(L, 1);
+        }
+        lua_pop(L, 2);
+    }
+    return false;
+}
+
+
+// "Name: " for a table with a `classname` method (see classes.lua): its
+// `class_desc`, or the global holding its class (or itself), or '?'
+void
+Inspector::ClassName(int i)
+{
+    if(!RawField(i, "classname")) {
+        return;
+    }
+    lua_pop(L, 1);
+
+    if(RawField(i, "class_desc")) {
+        if(lua_type(L, -1) == LUA_TSTRING) {
+            size_t len;
+            const char* s = lua_tolstring(L, -1, &len);
+            Write(s, len);
+            Write(": ");
+            lua_pop(L, 1);
+            return;
+        }
+        lua_pop(L, 1);
+    }
+
+    bool found = false;
+    lua_pushstring(L, "class");
+    lua_rawget(L, i);                                      // class
+    lua_pushglobaltable(L);
+    lua_pushnil(L);
+    while(lua_next(L, -2)) {                               // class _G k v
+        if(lua_type(L, -2) == LUA_TSTRING && (lua_rawequal(L, -1, -4) || lua_rawequal(L, -1, i))) {
+            size_t len;
+            const char* k = lua_tolstring(L, -2, &len);
+            Write(k, len);
+            lua_pop(L, 2);
+            found = true;
+            break;
+        }
+        lua_pop(L, 1);
+    }
+    lua_pop(L, 2);
+    Write(found ? ": " : "?: ");
+}
+
+
+void
+Inspector::Table(int i, int depth)
+{
+    const void* ptr = lua_topointer(L, i);
+    for(const void* v: visiting) {
+        if(v == ptr) {
+            Write("<cycle>");
+            return;
+        }
+    }
+
+    if(depth >= opt.max_depth || !lua_checkstack(L, 6)) {
+        size_t len = lua_rawlen(L, i);
+        if(len > 0) {
+            char buf[32];
+            Write(buf, snprintf(buf, sizeof(buf), "{#%zu}", len));
+        } else {
+            Write("{...}");
+        }
+        return;
+    }
+
+    visiting.push_back(ptr);
+    Write("{ ");
+    // an array: no key after the sequence (inspect.lua also takes sparse arrays)
+    lua_Integer len = static_cast<lua_Integer>(lua_rawlen(L, i));
+    if(len > 0) {
+        lua_pushinteger(L, len);
+    } else {
+        lua_pushnil(L);
+    }
+    bool array = !lua_next(L, i);
+    if(!array) {
+        lua_pop(L, 2);
+        lua_pushstring(L, "class");
+        lua_rawget(L, i);
+        if(lua_isnil(L, -1)) {
+            Write("@");
+        }
+        lua_pop(L, 1);
+        ClassName(i);
+    }
+
+    size_t n = 0;
+    lua_Integer next_index = 1;
+    lua_pushnil(L);
+    while(lua_next(L, i)) {          // key value
+        if(full || n == opt.max_elements) {
+            Write(n > 0 ? ", ..." : "...");
+            lua_pop(L, 2);
+            break;
+        }
+        if(Hidden(-2)) {
+            lua_pop(L, 1);
+            continue;
+        }
+        if(n++ > 0) {
+            Write(", ");
+        }
+        // sequential integer keys are printed as array items, everything else as key=value
+        if(lua_type(L, -2) == LUA_TNUMBER && lua_tonumber(L, -2) == static_cast<lua_Number>(next_index)) {
+            ++next_index;
+        } else {
+            if(lua_type(L, -2) == LUA_TSTRING) {
+                size_t len;
+                const char* k = lua_tolstring(L, -2, &len);
+                Write(k, len);
+            } else {
+                Write("[");
+                Value(lua_gettop(L) - 1, opt.max_depth);
+                Write("]");
+            }
+            Write("=");
+        }
+        Value(lua_gettop(L), depth + 1);
+        lua_pop(L, 1);
+    }
+    Write(" }");
+    visiting.pop_back();
+}
+
+
+void
+Inspector::Value(int i, int depth)
+{
+    if(full) {
+        return;
+    }
+
+    switch(lua_type(L, i)) {
+        case LUA_TNONE:
+        case LUA_TNIL:
+            Write("nil");
+            break;
+        case LUA_TBOOLEAN:
+            Write(lua_toboolean(L, i) ? "true" : "false");
+            break;
+        case LUA_TNUMBER:
+            Number(lua_tonumber(L, i));
+            break;
+        case LUA_TSTRING:
+            String(i);
+            break;
+        case LUA_TTABLE:
+            Table(i, depth);
+            break;
+        case LUA_TFUNCTION:
+            Write("[function]");
+            break;
+        default: {
+                char buf[64];
+                Write(buf, snprintf(buf, sizeof(buf), "%s: %p",
+                            lua_typename(L, lua_type(L, i)), lua_topointer(L, i)));
+            }
+    }
+}
+
+}  // anonymous namespace
+
+
+void
+LuaInterface::Inspect(ostream& os, int i, InspectOptions const& opt) const
+{
+    int s = StackSize();
+
+    Inspector(L(), os, opt).Value(lua_absindex(L(), i), 0);
+
+    assert(StackSize() == s);
+}
+
+
+string
+LuaInterface::Inspect(int i, InspectOptions const& opt) const
+{
+    stringstream ss;
+    Inspect(ss, i, opt);
+    return ss.str();
+}
+
+
+}  // namespace lua
+
+// vim: ts=4:sw=4:sts=4:expandtab
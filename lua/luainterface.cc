@@ -1,6 +1,5 @@
 
 #include "luainterface.h"
-#include "mylib.h"
 
 extern "C" {
     #include <lua.h>
@@ -17,23 +16,42 @@ extern "C" {
 
 namespace lua {
 
-LuaInterface::LuaInterface(function<void(string const&, void*)> error_cb, void* data)
+LuaInterface::LuaInterface(function<void(string const&, void*)> error_cb, void* data, 
+        MylibOptions const& mylib)
+    : LuaInterface(function<void(LuaError const&, void*)>([error_cb](LuaError const& e, void* d) { 
+                error_cb(e.what(), d); 
+            }), data, mylib)
+{
+}
+
+
+LuaInterface::LuaInterface(function<void(LuaError const&, void*)> error_cb, void* data, 
+        MylibOptions const& mylib)
     : l_state(luaL_newstate(), [](lua_State* l) { lua_close(l); }),  
       error_cb(error_cb), error_cb_data(data)
 {
     luaL_openlibs(L());
+    initialize_modules(*this);
 
     // store pointer to self (used to get this interface back from static methods)
     lua_pushlightuserdata(L(), reinterpret_cast<void*>(this));
     lua_setglobal(L(), "__engine_ptr");
 
 #ifdef DEBUG
-    Do("DEBUG = true");
+    lua_pushboolean(L(), true);
 #else
-    Do("DEBUG = false");
+    lua_pushboolean(L(), false);
 #endif
+    lua_setglobal(L(), "DEBUG");
     initialize_helper_functions(*this);
-    LoadBuffer(lua_mylib_luac, lua_mylib_luac_len);
+    initialize_functional(*this);
+    initialize_debugger(*this);
+    initialize_parallel(*this);
+    initialize_ffi(*this);
+    initialize_pool(*this);
+    initialize_events(*this);
+    LoadMylib(mylib);
+    host_functions = true;
 }
 
 
@@ -56,12 +74,17 @@ LuaInterface::get(lua_State* L)
 void 
 LuaInterface::LoadBuffer(unsigned char* code, size_t length) const
 {
+    TraceScope trace(tracer, "load", "preload");
+    memo.Invalidate();
     int r = luaL_loadbuffer(L(), reinterpret_cast<const char*>(code), length, "preload");
     if(r == LUA_ERRSYNTAX) {
         Error("Syntax error");
     }
     assert(r != LUA_ERRMEM);
 
+    if(static_strict) {
+        CheckGlobals("preload");
+    }
     if(Call(0, 0) == LUA_ERRRUN) {
         Error("Runtime error");
     }
@@ -73,12 +96,13 @@ LuaInterface::LoadSource(string const& filename, string const& path) const
 {
     // setup lua path
     if(path != "") {
-        static char value[512]; // should be enough...
-        snprintf(value, sizeof(value), "LUA_PATH=%s;;", path.c_str());
-        putenv(value);
+        SetModulePath(path + ";;");
     }
 
     // load source
+    TraceScope trace(tracer, "load", filename.c_str());
+    RecordScope record(recorder, L(), Recorder::LOAD, filename.c_str(), 0);
+    memo.Invalidate();
     int r = luaL_loadfile(L(), filename.c_str());
     if(r == LUA_ERRSYNTAX) {
         Error("Syntax error");
@@ -87,7 +111,12 @@ LuaInterface::LoadSource(string const& filename, string const& path) const
     }
     assert(r != LUA_ERRMEM);
 
-    if(Call(0, 0) == LUA_ERRRUN) {  /* TODO */
+    if(static_strict) {
+        CheckGlobals(filename);
+    }
+    int status = Call(0, 0);
+    record.Results(status, status == LUA_OK ? 0 : 1);
+    if(status == LUA_ERRRUN) {  /* TODO */
         Error("Runtime error");
     }
 }
@@ -116,27 +145,22 @@ LuaInterface::EnsureStackEmpty() const
 
 
 string
-LuaInterface::StackDump() const
+LuaInterface::StackDump(ostream* out, InspectOptions const& opt) const
 {
     int top = lua_gettop(L());
 
-    auto inspect = [&](int i) {
-        lua_getglobal(L(), "inspect");
-        lua_pushvalue(L(), i);
-        Call(1, 1);
-        string s(lua_tostring(L(), -1));
-        lua_pop(L(), 1);
-        return s;
-    };
-
     stringstream ss;
     ss << "Current lua stack:\n";
     for(int i=1; i<=top; ++i) {
-        ss << "  " << i << "/" << i-top-1 << ": " << inspect(i) << "\n";
+        ss << "  " << i << "/" << i-top-1 << ": ";
+        Inspect(ss, i, opt);
+        ss << "\n";
     }
     ss << "-----------------\n";
-    cerr << ss.str();
-    cerr.flush();
+    if(out) {
+        *out << ss.str();
+        out->flush();
+    }
     return ss.str();
 }
 
@@ -145,34 +169,101 @@ LuaInterface::StackDump() const
  * get info about object in stack
  */
 
-bool 
-LuaInterface::IsA(string klass, int i) const
+ClassRef
+LuaInterface::ResolveClass(string const& klass) const
 {
     int s = StackSize();
 
-    lua_pushvalue(L(), i);
+    ClassRef ref;
+    lua_getglobal(L(), klass.c_str());
+    if(!lua_istable(L(), -1)) {
+        lua_pop(L(), 1);
+        Error("Class `" + klass + "` not found.");
+        return ref;     // (not valid: resolved again next time)
+    }
+    ref.ptr = lua_topointer(L(), -1);
+    ref.ref = luaL_ref(L(), LUA_REGISTRYINDEX);   // (until ReleaseClass)
 
-    if(lua_type(L(), -1) != LUA_TTABLE) {
+    assert(s == StackSize());
+    return ref;
+}
+
+
+void
+LuaInterface::ReleaseClass(ClassRef& klass) const
+{
+    luaL_unref(L(), LUA_REGISTRYINDEX, klass.ref);
+    klass.ref = LUA_NOREF;
+    klass.ptr = nullptr;
+}
+
+
+bool
+LuaInterface::IsA(ClassRef const& klass, int i) const
+{
+    if(!klass.Valid() || lua_type(L(), i) != LUA_TTABLE) {
         return false;
     }
 
-    // stack:                          obj
-    lua_pushstring(L(), "is_a");      // obj "is_a"
-    lua_gettable(L(), -2);            // obj obj_is_a
+    int s = StackSize();
+    i = lua_absindex(L(), i);
 
-    if(lua_isnil(L(), -1)) { // no "is_a"
+    // fast path: instances have their class as metatable
+    if(lua_getmetatable(L(), i)) {
+        bool same = (lua_topointer(L(), -1) == klass.ptr);
         lua_pop(L(), 1);
-        return false;
+        if(same) {
+            return true;
+        }
     }
 
-    lua_getglobal(L(), klass.c_str());// obj obj_is_a klass
-    lua_gettable(L(), -2);            // obj obj_is_a value
-    bool v = lua_toboolean(L(), -1); 
-    lua_pop(L(), 2);                  // obj
+    // slow path: subclasses and static classes, through the `is_a` set (see classes.lua)
+    lua_getfield(L(), i, "is_a");                      // obj_is_a
+    if(!lua_istable(L(), -1)) {
+        lua_pop(L(), 1);
+        return false;
+    }
+    lua_rawgeti(L(), LUA_REGISTRYINDEX, klass.ref);    // obj_is_a klass
+    lua_rawget(L(), -2);                               // obj_is_a value
+    bool v = lua_toboolean(L(), -1);
+    lua_pop(L(), 2);
 
-    lua_pop(L(), 1);
     assert(s == StackSize());
+    return v;
+}
+
+
+bool 
+LuaInterface::IsA(string const& klass, int i) const
+{
+    if(lua_type(L(), i) != LUA_TTABLE) {
+        return false;
+    }
+
+    int s = StackSize();
+    i = lua_absindex(L(), i);
+
+    lua_getglobal(L(), klass.c_str());                 // klass
+    if(lua_getmetatable(L(), i)) {                     // klass mt
+        bool same = lua_rawequal(L(), -1, -2);
+        lua_pop(L(), 1);
+        if(same) {
+            lua_pop(L(), 1);
+            return true;
+        }
+    }
 
+    lua_getfield(L(), i, "is_a");                      // klass obj_is_a
+    if(!lua_istable(L(), -1)) {
+        lua_pop(L(), 2);
+        return false;
+    }
+    lua_pushvalue(L(), -2);                            // klass obj_is_a klass
+    lua_rawget(L(), -2);                               // klass obj_is_a value
+    bool v = lua_toboolean(L(), -1);
+    lua_pop(L(), 3);
+
+    assert(s == StackSize());
     return v;
 }
 
@@ -205,7 +296,11 @@ LuaInterface::Pop(int count) const
 void 
 LuaInterface::Push(int i) const 
 { 
-    lua_pushnumber(L(), i); 
+    if(NumberTraits::integer_subtype) {
+        lua_pushinteger(L(), i); 
+    } else {
+        lua_pushnumber(L(), i); 
+    }
 }
 
 
@@ -219,7 +314,14 @@ LuaInterface::Push(double i) const
 void 
 LuaInterface::Push(string const& s) const 
 { 
-    lua_pushstring(L(), s.c_str()); 
+    lua_pushlstring(L(), s.data(), s.size()); 
+}
+
+
+void 
+LuaInterface::Push(const char* s) const 
+{ 
+    lua_pushstring(L(), s); 
 }
 
 
@@ -234,13 +336,23 @@ void
 LuaInterface::Push(Point const& p) const
 {
     int s = StackSize();
-    CallGlobalFunction("Point", p.x, p.y);
+    if(table_pool.max_per_shape && point_class.Valid() && table_pool.Take(L(), TablePool::POINT)) {
+        // what the class constructor does, without `__init` (recycled Points only get x, y)
+        lua_rawgeti(L(), LUA_REGISTRYINDEX, point_class.ref);
+        lua_setfield(L(), -2, "class");
+        lua_pushnumber(L(), p.x);
+        lua_setfield(L(), -2, "x");
+        lua_pushnumber(L(), p.y);
+        lua_setfield(L(), -2, "y");
+    } else {
+        CallGlobalFunction("Point", p.x, p.y);
+    }
     assert(StackSize() == s+1);
 }
 
 
 void 
-LuaInterface::PushGlobal(string const& global) const
+LuaInterface::PushGlobal(CStringRef global) const
 {
     lua_getglobal(L(), global.c_str());
 }
@@ -252,7 +364,7 @@ LuaInterface::PushGlobal(string const& global) const
 
 
 bool 
-LuaInterface::HasAttr(string const& field, int i) const
+LuaInterface::HasAttr(CStringRef field, int i) const
 {
     int s = StackSize();
 
@@ -270,7 +382,7 @@ LuaInterface::HasAttr(string const& field, int i) const
 
 
 void 
-LuaInterface::PushAttr(string const& attr, int i) const 
+LuaInterface::PushAttr(CStringRef attr, int i) const 
 {
     if(!IsA(LUA_TTABLE, i)) {
         Error("Index is not a table");
@@ -352,11 +464,11 @@ LuaInterface::ForEachPair(function<void()> f) const
 
 
 void 
-LuaInterface::ForEachAttr(string const& attr, function<void(int)> f, int i) const
+LuaInterface::ForEachAttr(CStringRef attr, function<void(int)> f, int i) const
 {
     PushAttr(attr);
     if(!lua_istable(L(), i)) {
-        Error("Attribute '" + attr + "' is not a table");
+        Error(string("Attribute '") + attr.c_str() + "' is not a table");
     }
     ForEach(f, i);
     Pop();
@@ -372,14 +484,26 @@ int
 LuaInterface::Call(int nargs, int nresults) const
 {
     int s = StackSize();
+    int status;
+    {
+        TraceScope trace(tracer, "lua", "Call");
+
+        int base = lua_gettop(L()) - nargs;
+        lua_pushcfunction(L(), Traceback);
+        lua_insert(L(), base);
+        ++lua_depth;
+        status = lua_pcall(L(), nargs, nresults, base);
+        if(--lua_depth == 0) {
+            raised.reset();     // (caught by a script)
+        }
+        lua_remove(L(), base);
+    }
 
-    int base = lua_gettop(L()) - nargs;
-    lua_pushcfunction(L(), Traceback);
-    lua_insert(L(), base);
-    int status = lua_pcall(L(), nargs, nresults, base);
-    lua_remove(L(), base);
+    if(status != LUA_OK && throw_errors && last_error) {
+        RaiseLastError();
+    }
 
-    if(nresults != LUA_MULTRET) {
+    if(status == LUA_OK && nresults != LUA_MULTRET) {
         assert(StackSize() == s + nresults - nargs - 1);
     }
     
@@ -387,6 +511,20 @@ LuaInterface::Call(int nargs, int nresults) const
 }
 
 
+// after a call that failed (without ThrowOnError), the error message is
+// replaced by `nresults` nils, so that the caller finds what it asked for
+void
+LuaInterface::NormalizeResults(int status, int nresults) const
+{
+    if(status != LUA_OK && nresults != LUA_MULTRET) {
+        lua_pop(L(), 1);
+        for(int i=0; i<nresults; ++i) {
+            lua_pushnil(L());
+        }
+    }
+}
+
+
 int 
 LuaInterface::ParameterCount() const
 {
@@ -402,9 +540,12 @@ LuaInterface::RegisterFunction(string const& name, lua_CFunction f) const
 {
     int s = StackSize();
 
-    Do(name + " = nil");  // skip strict
-    lua_pushcfunction(L(), f);
-    lua_setglobal(L(), name.c_str());
+    DeclareGlobal(name.c_str());
+    lua_pushglobaltable(L());
+    lua_pushstring(L(), name.c_str());
+    PushFunction(name, f);
+    lua_rawset(L(), -3);
+    Pop();
 
     assert(StackSize() == s);
 }
@@ -419,7 +560,7 @@ LuaInterface::RegisterFunction(string const& parent, string const& name, lua_CFu
     if(!lua_istable(L(), -1)) {
         Error("Expected table");
     }
-    lua_pushcfunction(L(), f);
+    PushFunction(parent + "." + name, f);
     lua_setfield(L(), -2, name.c_str());
     Pop();
 
@@ -427,6 +568,100 @@ LuaInterface::RegisterFunction(string const& parent, string const& name, lua_CFu
 }
 
 
+// `funcs` ends with { nullptr, nullptr }, as for luaL_setfuncs. With `lazy`, the
+// library is only built on its first access (or `require`): it is registered in
+// package.preload, and in the lazy globals of mylib (see luamylib.cc). The array
+// must then outlive the interface.
+void
+LuaInterface::RegisterLibrary(string const& name, luaL_Reg const* funcs, bool lazy) const
+{
+    int s = StackSize();
+
+    DeclareGlobal(name.c_str());
+    if(!lazy) {
+        lua_pushglobaltable(L());
+        lua_pushstring(L(), name.c_str());
+        PushLibrary(name, funcs);
+        lua_rawset(L(), -3);
+        Pop();
+    } else {
+        lua_getglobal(L(), "package");
+        lua_getfield(L(), -1, "preload");
+        lua_pushlightuserdata(L(), const_cast<luaL_Reg*>(funcs));
+        lua_pushcclosure(L(), LoadLibrary, 1);
+        lua_setfield(L(), -2, name.c_str());
+        lua_getfield(L(), LUA_REGISTRYINDEX, "mylib.lazy_globals");
+        lua_pushstring(L(), name.c_str());
+        lua_setfield(L(), -2, name.c_str());
+        lua_pop(L(), 3);
+    }
+
+    assert(StackSize() == s);
+}
+
+
+// push the library table (the existing global, if it is a table), with the functions set.
+// They are only wrapped (see PushFunction) while tracing or recording, or with
+// ThrowOnError (the wrapper turns exceptions into Lua errors).
+void
+LuaInterface::PushLibrary(string const& name, luaL_Reg const* funcs) const
+{
+    int n = 0;
+    while(funcs[n].name) {
+        ++n;
+    }
+    lua_pushglobaltable(L());
+    lua_pushstring(L(), name.c_str());
+    lua_rawget(L(), -2);
+    lua_remove(L(), -2);
+    if(!lua_istable(L(), -1)) {
+        lua_pop(L(), 1);
+        lua_createtable(L(), 0, n);
+    }
+    if(!tracer.Enabled() && !recorder.Enabled() && !throw_errors) {
+        luaL_setfuncs(L(), funcs, 0);
+        return;
+    }
+    for(int i=0; i<n; ++i) {
+        PushFunction(name + "." + funcs[i].name, funcs[i].func);
+        lua_setfield(L(), -2, funcs[i].name);
+    }
+}
+
+
+// package.preload loader of a lazy library: upvalue 1 is the luaL_Reg array
+int
+LuaInterface::LoadLibrary(lua_State* L)
+{
+    const char* name = luaL_checkstring(L, 1);
+    auto funcs = reinterpret_cast<luaL_Reg const*>(lua_touserdata(L, lua_upvalueindex(1)));
+    LuaInterface::get(L).PushLibrary(name, funcs);
+    lua_pushglobaltable(L);
+    lua_pushstring(L, name);
+    lua_pushvalue(L, -3);
+    lua_rawset(L, -3);
+    lua_pop(L, 1);
+    return 1;
+}
+
+
+// mark a global as declared for strict.lua, without running any Lua code
+void
+LuaInterface::DeclareGlobal(const char* name) const
+{
+    lua_pushglobaltable(L());
+    if(lua_getmetatable(L(), -1)) {
+        lua_getfield(L(), -1, "__declared");
+        if(lua_istable(L(), -1)) {
+            lua_pushboolean(L(), true);
+            lua_setfield(L(), -2, name);
+        }
+        lua_pop(L(), 2);
+    }
+    Pop();
+}
+
+
 /*
  * Debug
  */
@@ -456,35 +691,6 @@ LuaInterface::Locals() const
 }
 
 
-void 
-LuaInterface::CallOnNextLine(function<void()> f) const
-{
-    call_on_break = f;
-    lua_sethook(L(), [](lua_State* L, lua_Debug*) { 
-        lua_sethook(L, nullptr, LUA_MASKLINE, 0);  // disable hook
-        lua_getglobal(L, "__engine_ptr");
-        LuaInterface* luax = reinterpret_cast<LuaInterface*>(lua_touserdata(L, -1));
-        luax->call_on_break();
-    }, LUA_MASKLINE, 0);
-}
-
-
-void 
-LuaInterface::CallOnNextReturn(function<void()> f) const
-{
-    call_on_break = f;
-    last_call_stack_size = CallStackSize();
-    lua_sethook(L(), [](lua_State* L, lua_Debug*) { 
-        lua_getglobal(L, "__engine_ptr");
-        LuaInterface* luax = reinterpret_cast<LuaInterface*>(lua_touserdata(L, -1));
-        if(luax->CallStackSize() <= luax->last_call_stack_size) {
-            lua_sethook(L, nullptr, LUA_MASKLINE, 0);  // disable hook
-            luax->call_on_break();
-        }
-    }, LUA_MASKLINE, 0);
-}
-
-
 int 
 LuaInterface::CallStackSize() const
 {
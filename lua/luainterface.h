@@ -6,37 +6,231 @@ extern "C" {
     #include <lauxlib.h>
     #include <lualib.h>
 }
+#include "luacompat.h"
 
+#include <cassert>
+#include <cstdint>
 #include <exception>
 #include <functional>
+#include <future>
+#include <iostream>
 #include <memory>
 #include <string>
+#include <thread>
+#include <tuple>
 #include <type_traits>
+#include <utility>
+#include <unordered_map>
 #include <vector>
 using namespace std;
 
 #include "point.h"
+#include "luadebugger.h"
+#include "luaasync.h"
+#include "luaevents.h"
+#include "luaexecutor.h"
+#include "luaheap.h"
+#include "luamemo.h"
+#include "luamodules.h"
+#include "luaparallel.h"
+#include "luapool.h"
+#include "luarecord.h"
+#include "luatrace.h"
 
 struct lua_State;
 
 namespace lua {
 
+class LuaInterface;
+
+// limits for the native value inspector (see luainspect.cc)
+struct InspectOptions {
+    int    max_depth    = 2;      // tables nested deeper are summarized as {#n} or {...}
+    size_t max_elements = 32;     // entries printed per table
+    size_t max_bytes    = 4096;   // total output per inspected value
+};
+
+// mylib modules made available to scripts (in luamylib.cc)
+struct MylibOptions {
+    vector<string> modules;    // modules registered in package.preload (empty: all)
+    vector<string> eager = { "strict", "math", "string_mp" };  // executed right away; the
+                               // others load on `require` or on first access to their globals
+    bool static_strict = false; // check undeclared globals when loading chunks, instead of
+                                // on each access (see luastrict.cc)
+};
+
+// error raised by the interface or by a script (in luaerror.cc)
+class LuaError : public exception {
+public:
+    struct LuaFrame {
+        string source;
+        string what;
+        string name;
+        string namewhat;
+        int currentline;
+        int linedefined;
+    };
+
+    LuaError(string message, vector<LuaFrame> lua_frames, vector<void*> cpp_frames);
+    static LuaError Capture(lua_State* L, string message, int level=1);
+
+    string const&           Message() const { return message; }
+    vector<LuaFrame> const& LuaFrames() const;
+    string                  LuaTraceback() const;
+    vector<string>          CppTraceback() const;
+    const char*             what() const noexcept override;
+
+private:
+    // a frame as captured: `what` and `namewhat` are static strings of Lua, the
+    // source and the name are offsets in `raw_strings`
+    struct RawFrame {
+        const char* what;
+        const char* namewhat;
+        uint32_t    source;
+        uint32_t    name;
+        int         currentline;
+        int         linedefined;
+    };
+
+    string message;
+    vector<RawFrame> raw_frames;
+    string raw_strings;
+    mutable vector<LuaFrame> lua_frames;     // (formatted from raw_frames when read)
+    vector<void*> cpp_frames;
+    mutable string report;
+};
+
+// a value that may be missing (nil), for trailing results of a call
+template<typename T>
+class Optional {
+public:
+    typedef T value_type;
+
+    Optional() {}
+    Optional(T const& value) : value(value), has(true) {}
+
+    bool HasValue() const { return has; }
+    explicit operator bool() const { return has; }
+    T const& operator*() const { return value; }
+    T const* operator->() const { return &value; }
+    T ValueOr(T const& def) const { return has ? value : def; }
+
+private:
+    T    value = T();
+    bool has = false;
+};
+
+template<class T> struct IsTuple : false_type {};
+template<class... T> struct IsTuple<tuple<T...>> : true_type {};
+template<class T> struct IsOptional : false_type {};
+template<class T> struct IsOptional<Optional<T>> : true_type {};
+
+// number of Lua values decoded into a T (a tuple takes one per element)
+template<class T> struct ResultCount : integral_constant<int, 1> {};
+template<class... T> struct ResultCount<tuple<T...>> : integral_constant<int, sizeof...(T)> {};
+
+// a borrowed NUL-terminated string: names given as literals or as `string`
+// are passed down to the Lua API without building a temporary `string`
+class CStringRef {
+public:
+    CStringRef(const char* s) : s(s) {}
+    CStringRef(string const& s) : s(s.c_str()) {}
+    const char* c_str() const { return s; }
+
+private:
+    const char* s;
+};
+
+// how the parameters of a submitted call are kept until it runs (strings are copied)
+template<class T> struct StoredArg { typedef typename decay<T>::type type; };
+template<> struct StoredArg<const char*> { typedef string type; };
+template<> struct StoredArg<char*> { typedef string type; };
+
+// a class table resolved once, for fast `IsA` checks
+class ClassRef {
+public:
+    bool Valid() const { return ref != LUA_NOREF && ref != LUA_REFNIL; }
+
+private:
+    int         ref = LUA_NOREF;   // class table in the registry
+    const void* ptr = nullptr;     // class table identity (metatable of its instances)
+
+    friend class LuaInterface;
+};
+
+// a path such as "world.entities[3].pos.x", compiled once: the keys are
+// Lua strings held in the registry, and the tables are walked with raw
+// access. Optionally, the table holding the last key is kept after the
+// first lookup (until `InvalidateCache`); a path can be moved but not copied,
+// and must not outlive its interface. (in luapath.cc)
+class LuaPath {
+public:
+    LuaPath() {}
+    LuaPath(LuaPath&& other);
+    LuaPath& operator=(LuaPath&& other);
+    ~LuaPath();
+
+    string const& Text() const { return text; }
+    void InvalidateCache() const { parent_valid = false; }
+
+private:
+    struct Step {
+        int         key = LUA_NOREF;   // string key in the registry (LUA_NOREF: integer index)
+        lua_Integer index = 0;
+    };
+
+    string       text;
+    vector<Step> steps;
+    bool         cache_parent = false;
+    LuaInterface const* owner = nullptr;     // (releases parent_ref)
+    mutable int  parent_ref = LUA_NOREF;
+    mutable bool parent_valid = false;
+
+    void Release();
+
+    LuaPath(LuaPath const&) = delete;
+    LuaPath& operator=(LuaPath const&) = delete;
+
+    friend class LuaInterface;
+};
+
 class LuaInterface {
 public:
-    LuaInterface(function<void(string const&, void*)> error_cb, void* data);
+    LuaInterface(function<void(string const&, void*)> error_cb, void* data, 
+            MylibOptions const& mylib = MylibOptions());
+    LuaInterface(function<void(LuaError const&, void*)> error_cb, void* data, 
+            MylibOptions const& mylib = MylibOptions());
     static LuaInterface& get(lua_State* L);
 
     // load source
     void LoadBuffer(unsigned char* code, size_t length) const;
     void LoadSource(string const& filename, string const& path = "") const;
+    void Require(string const& module) const;
+
+    // compile on a worker thread; the future is ready once the script has run,
+    // in RunCompiledScripts, or holds the error (in luaasync.cc)
+    future<void> LoadSourceAsync(string const& filename) const;
+    size_t RunCompiledScripts() const;
+
+    // module search path (in luamodules.cc)
+    void SetModulePath(string const& path) const;
+    void WatchModules(bool watch) const;
+    void LoadBundle(string const& filename) const;
 
     // examine stack
     int    StackSize() const;
-    string StackDump() const;
+    string StackDump(ostream* out = &cerr, InspectOptions const& opt = InspectOptions()) const;
     void   EnsureStackEmpty() const;
 
+    // inspect values (in luainspect.cc)
+    void   Inspect(ostream& os, int i=-1, InspectOptions const& opt = InspectOptions()) const;
+    string Inspect(int i=-1, InspectOptions const& opt = InspectOptions()) const;
+
     // get info about object in stack
-    bool IsA(string klass, int i=-1) const;
+    ClassRef ResolveClass(string const& klass) const;
+    void ReleaseClass(ClassRef& klass) const;
+    bool IsA(ClassRef const& klass, int i=-1) const;
+    bool IsA(string const& klass, int i=-1) const;
     bool IsA(int lua_type, int i=-1) const;
     bool IsNil(int i=-1) const;
     template<class T> typename enable_if<is_floating_point<T>::value, T>::type Get(int i=-1) const;
@@ -45,7 +239,15 @@ public:
     template<class T> typename enable_if<is_pointer<T>::value, T>::type        Get(int i=-1) const;
     template<class T> typename enable_if<is_same<T, Point>::value, T>::type    Get(int i=-1) const;
     template<class T> typename enable_if<is_same<T, vector<typename T::value_type, typename T::allocator_type>>::value, T>::type Get(int i=-1) const;
-    template<class T> T GetGlobal(string const& variable) const;
+    template<class T> typename enable_if<IsTuple<T>::value, T>::type           Get(int i=-1) const;
+    template<class T> typename enable_if<IsOptional<T>::value, T>::type        Get(int i=-1) const;
+    template<class T> T GetGlobal(CStringRef variable) const;
+
+    // nested values by path (in luapath.cc)
+    LuaPath Path(string const& expr, bool cache_parent=false) const;
+    void PushPath(LuaPath const& path) const;
+    template<class T> T Get(LuaPath const& path) const;
+    template<class T> void Set(LuaPath const& path, T const& value) const;
 
     // remove things from stack
     void                                                                       Pop(int count=1) const;
@@ -56,43 +258,62 @@ public:
     void Push(int i) const;
     void Push(double i) const;
     void Push(string const& s) const;
+    void Push(const char* s) const;
     void Push(bool b) const;
     void Push(Point const& p) const;
     template<class T> void Push(T* ptr) const;
     template<typename T> void Push(vector<T> const& v) const;
-    void PushGlobal(string const& global) const;
+    void PushGlobal(CStringRef global) const;
 
     // lua object attributes
-    bool HasAttr(string const& field, int i=-1) const;
-    void PushAttr(string const& attr, int i=-1) const;
-    template<class T> T GetAttr(string const& attr, int i=-1) const;
-    template<class T> T GetAttrDef(string const& attr, T const& def, int i=-1) const;
-    template<class T> void SetAttr(string const& attr, T const& value, int i=-1) const;
+    bool HasAttr(CStringRef field, int i=-1) const;
+    void PushAttr(CStringRef attr, int i=-1) const;
+    template<class T> T GetAttr(CStringRef attr, int i=-1) const;
+    template<class T> T GetAttrDef(CStringRef attr, T const& def, int i=-1) const;
+    template<class T> void SetAttr(CStringRef attr, T const& value, int i=-1) const;
 
     // loop a table or array
     void ForEach(function<void(int)> f, int i=-1) const;
     void ForEachPair(function<void()> f) const;
     void ForEachKey(function<void(int)> f) const;
-    void ForEachAttr(string const& attr, function<void(int)> f, int i=-1) const;
+    void ForEachAttr(CStringRef attr, function<void(int)> f, int i=-1) const;
 
     // function calls
-    template<class ...P> void CallFunctionInStack(P... pars) const;
-    template<typename T, class ...P> T CallFunctionInStack(P... pars) const;
-    template<class ...P> void CallMethod(string const& method, P... pars) const;
-    template<class ...P> void CallVoidMethod(string const& method, P... pars) const;
-    template<typename T, class ...P> T CallMethod(string const& method, P... pars) const;
-    template<class ...P> void CallGlobalFunction(string const& f, P... pars) const;
-    template<typename T, class ...P> T CallGlobalFunction(string const& f, P... pars) const;
+    // (`NoResultType` can't be given, so that `CallX<T>(...)` always selects the version returning T)
+    template<int&... NoResultType, class ...P> void CallFunctionInStack(P&&... pars) const;
+    template<typename T, class ...P> T CallFunctionInStack(P&&... pars) const;
+    template<int&... NoResultType, class ...P> void CallMethod(CStringRef method, P&&... pars) const;
+    template<class ...P> void CallVoidMethod(CStringRef method, P&&... pars) const;
+    template<typename T, class ...P> T CallMethod(CStringRef method, P&&... pars) const;
+    template<int&... NoResultType, class ...P> void CallGlobalFunction(CStringRef f, P&&... pars) const;
+    template<typename T, class ...P> T CallGlobalFunction(CStringRef f, P&&... pars) const;
     int Call(int nargs, int nresults) const;
     int ParameterCount() const;
 
+    // calls of pure functions: the results are cached by arguments, and repeated
+    // calls don't enter Lua. Invalidated on LoadSource/LoadBuffer (in luamemo.cc)
+    template<typename T, class ...P> T CallPureFunction(CStringRef f, P&&... pars) const;
+    void SetPureCacheSize(size_t max_entries) const;     // 0: disabled (default 1024)
+    void InvalidatePure() const;
+    void InvalidatePure(CStringRef f) const;
+    MemoStats const& PureStats() const { return memo.stats; }
+
     // immediate commands
     template<typename T> T Do(string const& code) const;
     void Do(string const& code) const;
 
+    // events, to the handlers subscribed from Lua (in luaevents.cc)
+    template<class ...P> void Emit(CStringRef event, P&&... pars) const;           // right away
+    template<class ...P> void Post(CStringRef event, P&&... pars) const;           // on FlushEvents
+    template<class ...P> void PostCoalesced(CStringRef event, P&&... pars) const;  // (only the last one)
+    size_t FlushEvents() const;
+    size_t EventsDispatched() const { return events.dispatched; }
+
     // call C++ functions from Lua
     void RegisterFunction(string const& name, lua_CFunction f) const;
     void RegisterFunction(string const& parent, string const& name, lua_CFunction f) const;
+    void RegisterLibrary(string const& name, luaL_Reg const* funcs, bool lazy=false) const;
+    template<typename In, typename Out, typename F> void RegisterKernel(string const& name, F f) const;
 
     // manage userdata
     template<typename Class, typename ...ParamType, typename... String> void RegisterConstructor(String... pars) const;
@@ -108,38 +329,149 @@ public:
     };
     SourceLine CurrentLine() const;
     vector<string> Locals() const;
+    int CallStackSize() const;
+
+    // breakpoints and stepping (in luadebugger.cc)
     void CallOnNextLine(function<void()> f) const;
     void CallOnNextReturn(function<void()> f) const;
-    int CallStackSize() const;
+    void AddBreakpoint(string const& source, int line, function<void()> f) const;
+    void RemoveBreakpoint(string const& source, int line) const;
 
-    // error management (in luaerror.cc)
-    void Error(string s) const;
+    // recycled tables for Push of vectors and Points (in luapool.cc)
+    void EnableTablePool(size_t max_per_shape) const;     // 0: disabled
+    void ReleaseTable(int i=-1) const;
+    TablePoolStats const& PoolStats() const { return table_pool.stats; }
+
+    // timeline of calls, in Chrome trace format (in luatrace.cc)
+    void Trace(bool enable) const;
+    void TraceExport(ostream& out, bool clear=false) const;
+
+    // heap profiling: allocations sampled every `sample_bytes`, by line of the
+    // scripts (in luaheap.cc)
+    void HeapProfile(bool enable, size_t sample_bytes=4096) const;
+    HeapSnapshot TakeHeapSnapshot() const;
+    void HeapReport(ostream& out, size_t top=20) const;
+    static void HeapDiff(ostream& out, HeapSnapshot const& before, HeapSnapshot const& after, size_t top=20);
+
+    // record the calls into Lua, and replay them offline (in luarecord.cc)
+    bool Record(string const& filename) const;
+    void StopRecording() const;
+    bool Replay(string const& filename, ostream& report) const;
+
+    // calls from other threads: queued without locks, and run by the owner thread
+    // in RunSubmitted; the results (or exceptions, with ThrowOnError) are given in
+    // futures. In DEBUG, using the interface from another thread aborts. (in luaexecutor.cc)
+    template<class F> auto Submit(F f) const -> future<decltype(f(*this))>;
+    template<typename T, class ...P> future<T> SubmitCall(string const& f, P&&... pars) const;
+    template<typename T> future<T> SubmitDo(string const& code) const;
+    size_t RunSubmitted(size_t max=SIZE_MAX) const;
+    void SetOwnerThread();     // the calling thread becomes the owner
 
-    inline lua_State* L() const { return l_state.get(); }
+    // error management (in luaerror.cc). With ThrowOnError, Error throws a LuaError;
+    // in a C function called by Lua, it is caught when it leaves the function, once
+    // the C++ frames are unwound, raised as a Lua error, and thrown again by Call.
+    void Error(string const& s) const;
+    void ThrowOnError(bool v) { throw_errors = v; }
+    LuaError const* LastError() const { return last_error.get(); }
+
+    inline lua_State* L() const {
+#ifdef DEBUG
+        assert(this_thread::get_id() == owner && "LuaInterface used from a thread other than its owner");
+#endif
+        return l_state.get();
+    }
 
 private:
     // private templates
     template<class T, typename... S> T* InitializeObject(T* t);
-    template<class Arg1, class... Args> void PushParameters(const Arg1& arg1, const Args&... args) const;
+    template<class Arg1, class... Args> void PushParameters(Arg1&& arg1, Args&&... args) const;
+    template<class T, size_t... I> T GetTuple(int first, index_sequence<I...>) const;
+    template<class ...P> void CallMethodN(int nresults, CStringRef method, P&&... pars) const;
+    template<class ...P> void CallFunctionInStackN(int nresults, P&&... pars) const;
+    template<class ...P> int CallGlobalFunctionN(int nresults, CStringRef f, P&&... pars) const;
+    void NormalizeResults(int status, int nresults) const;
     void PushParameters() const;
+    void LoadMylib(MylibOptions const& opt) const;
+    void CheckGlobals(string const& chunkname) const;
+    void DeclareGlobal(const char* name) const;
+    void PushLibrary(string const& name, luaL_Reg const* funcs) const;
+    static int LoadLibrary(lua_State* L);
+
+    // events (in luaevents.cc)
+    void DispatchEvent(const char* event, int nargs) const;
+    void QueueEvent(const char* event, int nargs, bool coalesce) const;
+
+    // submitted calls (in luaexecutor.cc)
+    template<typename T, class Tuple, size_t... I> typename enable_if<!is_void<T>::value, T>::type
+        CallStored(string const& f, Tuple const& args, index_sequence<I...>) const;
+    template<typename T, class Tuple, size_t... I> typename enable_if<is_void<T>::value>::type
+        CallStored(string const& f, Tuple const& args, index_sequence<I...>) const;
+    template<typename T> typename enable_if<!is_void<T>::value, T>::type DoStored(string const& code) const { return Do<T>(code); }
+    template<typename T> typename enable_if<is_void<T>::value>::type     DoStored(string const& code) const { Do(code); }
+    template<typename T, class F> static void Fulfill(promise<T>& p, F&& f);
+    template<class F> static void Fulfill(promise<void>& p, F&& f);
+
+    // paths (in luapath.cc)
+    bool PushPathParent(LuaPath const& path) const;
+    void PushPathKey(LuaPath const& path) const;
+
+    // LuaJIT FFI fast paths (in luaffi.cc)
+    bool FfiGet(int i, Point& p) const;
+    bool FfiGet(int i, vector<double>& v) const;
+    template<class T> bool FfiGet(int, T&) const { return false; }
 
     // error management (in luaerror.cc)
     static int Traceback(lua_State* l);
     static string Demangle(string s);
+    [[noreturn]] void RaiseLastError() const;
+
+    // tracing (in luatrace.cc)
+    static int TracedFunction(lua_State* L);
+    void PushFunction(string const& name, lua_CFunction f) const;
 
     // internal members
+    mutable Tracer tracer;     // (before the state: finalizers may call registered functions)
+    mutable Recorder recorder;
+    mutable HeapProfiler heap; // (its allocator is used until the state is closed)
     unique_ptr<lua_State, function<void(lua_State*)>> l_state;
-    function<void(string const&, void*)> error_cb;
+    function<void(LuaError const&, void*)> error_cb;
     void* error_cb_data;
+    bool throw_errors = false;
+    bool host_functions = false;    // functions registered from now on are recorded
+    mutable unique_ptr<LuaError> last_error;
+    mutable int lua_depth = 0;          // calls into Lua running (C functions may be on the stack)
+    mutable unique_ptr<LuaError> raised; // thrown in a C function, on its way to Traceback
+    mutable bool quiet_errors = false;  // script errors are not given to the error callback
+
+    mutable ClassRef point_class;
+    mutable bool static_strict = false;
 
-    mutable function<void()> call_on_break = nullptr;
-    mutable int last_call_stack_size = 0;
+    mutable Debugger debugger;
+    mutable ModuleResolver modules;
+    mutable TablePool table_pool;
+    mutable MemoCache memo;
+    mutable EventBus events;
+    mutable CommandQueue commands;
+    thread::id owner = this_thread::get_id();
+    mutable ScriptCompiler compiler;
+    mutable unordered_map<string, int> path_keys;   // registry refs of the path keys
+
+    mutable unordered_map<string, function<void(int, int)>> kernels;   // parallel_map (in luaparallel.cc)
 
     // constructors
     LuaInterface(LuaInterface const& other) = delete;
     LuaInterface(LuaInterface&& other) = delete;
     LuaInterface& operator=(LuaInterface const& other) = delete;
     LuaInterface& operator=(LuaInterface&& other) = delete;
+
+    friend class LuaError;
+    friend class Debugger;
+    friend void initialize_debugger(LuaInterface const& luax);
+    friend void initialize_modules(LuaInterface const& luax);
+    friend void initialize_parallel(LuaInterface const& luax);
+    friend void initialize_ffi(LuaInterface const& luax);
+    friend void initialize_pool(LuaInterface const& luax);
+    friend void initialize_events(LuaInterface const& luax);
 };
 
 }  // namespace lua
@@ -23,6 +23,11 @@ LuaInterface::Get(int i) const
 template<class T> inline typename enable_if<is_integral<T>::value, T>::type 
 LuaInterface::Get(int i) const 
 { 
+#if LUAX_INTEGER_SUBTYPE
+    if(lua_isinteger(L(), i)) {
+        return static_cast<T>(lua_tointeger(L(), i));
+    }
+#endif
     if(lua_isnumber(L(), i)) {
         return lua_tonumber(L(), i);
     } else if(lua_isboolean(L(), i)) {
@@ -58,9 +63,17 @@ LuaInterface::Get(int i) const {
 template<class T> typename enable_if<is_same<T, Point>::value, T>::type
 LuaInterface::Get(int i) const
 {
+    Point p;
+    if(NumberTraits::ffi && FfiGet(i, p)) {
+        return p;
+    }
+
     int s = StackSize();
     lua_pushvalue(L(), i);
-    if(!IsA("Point")) {
+    if(!point_class.Valid()) {
+        point_class = ResolveClass("Point");
+    }
+    if(!IsA(point_class)) {
         Error("Expected Point");
     }
     auto x = GetAttr<double>("x"),
@@ -77,6 +90,9 @@ LuaInterface::Get(int i) const
     int s = StackSize();
 
     T v;
+    if(NumberTraits::ffi && FfiGet(i, v)) {
+        return v;
+    }
     if(!lua_istable(L(), i)) {
         Error("Expected table.");
     }
@@ -93,8 +109,27 @@ LuaInterface::Get(int i) const
 }
 
 
+// the last tuple_size<T> values of the stack, ending at `i`
+template<class T> typename enable_if<IsTuple<T>::value, T>::type
+LuaInterface::Get(int i) const
+{
+    int first = (i < 0 ? lua_gettop(L()) + i + 1 : i) - static_cast<int>(tuple_size<T>::value) + 1;
+    return GetTuple<T>(first, make_index_sequence<tuple_size<T>::value>());
+}
+
+
+template<class T> typename enable_if<IsOptional<T>::value, T>::type
+LuaInterface::Get(int i) const
+{
+    if(lua_isnoneornil(L(), i)) {
+        return T();
+    }
+    return T(Get<typename T::value_type>(i));
+}
+
+
 template<class T> inline T 
-LuaInterface::GetGlobal(string const& variable) const
+LuaInterface::GetGlobal(CStringRef variable) const
 {
     lua_getglobal(L(), variable.c_str());
     auto t = Get<T>();
@@ -103,6 +138,14 @@ LuaInterface::GetGlobal(string const& variable) const
 }
 
 
+template<class T> inline T
+LuaInterface::Get(LuaPath const& path) const
+{
+    PushPath(path);
+    return Pop<T>();
+}
+
+
 /*
  * remove things from the stack
  */
@@ -113,8 +156,8 @@ LuaInterface::Pop() const
 {
     int s = StackSize();
     T t = Get<T>(-1);
-    lua_pop(L(), 1);
-    assert(StackSize() == s-1);
+    lua_pop(L(), ResultCount<T>::value);
+    assert(StackSize() == s-ResultCount<T>::value);
     return t;
 }
 
@@ -135,7 +178,9 @@ template<typename T> inline void
 LuaInterface::Push(vector<T> const& v) const
 {
     int s = StackSize();
-    lua_createtable(L(), v.size(), 0);
+    if(!table_pool.Take(L(), TablePool::ArrayShape(v.size()))) {
+        lua_createtable(L(), v.size(), 0);
+    }
     int i = 1;
     for(auto const& t: v) {
         Push(t);
@@ -149,7 +194,7 @@ LuaInterface::Push(vector<T> const& v) const
  * lua object attributes
  */
 template<typename T> inline T 
-LuaInterface::GetAttr(string const& attr, int i) const 
+LuaInterface::GetAttr(CStringRef attr, int i) const 
 {
     if(!IsA(LUA_TTABLE, i)) {
         Error("Index is not a table");
@@ -161,7 +206,7 @@ LuaInterface::GetAttr(string const& attr, int i) const
 
 
 template<class T> inline T 
-LuaInterface::GetAttrDef(string const& attr, T const& def, int i) const
+LuaInterface::GetAttrDef(CStringRef attr, T const& def, int i) const
 {
     if(!IsA(LUA_TTABLE, i)) {
         Error("Index is not a table");
@@ -178,7 +223,7 @@ LuaInterface::GetAttrDef(string const& attr, T const& def, int i) const
 
 
 template<class T> inline void 
-LuaInterface::SetAttr(string const& attr, T const& value, int i) const
+LuaInterface::SetAttr(CStringRef attr, T const& value, int i) const
 {
     Push(value);
 
@@ -190,112 +235,200 @@ LuaInterface::SetAttr(string const& attr, T const& value, int i) const
 }
 
 
+template<class T> inline void
+LuaInterface::Set(LuaPath const& path, T const& value) const
+{
+    int s = StackSize();
+
+    if(!PushPathParent(path)) {
+        Pop();
+        Error("Path `" + path.Text() + "`: not a table.");
+        return;
+    }
+    PushPathKey(path);
+    Push(value);
+    lua_rawset(L(), -3);
+    Pop();
+
+    assert(StackSize() == s);
+}
+
+
 /* 
  * function call
  */
 
+template<int&... NoResultType, class ...P> inline void 
+LuaInterface::CallMethod(CStringRef method, P&&... pars) const 
+{
+    CallMethodN(1, method, forward<P>(pars)...);
+}
+
+
 template<class ...P> inline void 
-LuaInterface::CallMethod(string const& method, P... pars) const 
+LuaInterface::CallVoidMethod(CStringRef method, P&&... pars) const
 {
-    int s = StackSize();
+    CallMethodN(0, method, forward<P>(pars)...);
+}
 
-    lua_getfield(L(), -1, method.c_str());
-    if(lua_isnil(L(), -1)) {
-        Error("Method `" + method + "` not found.");
-    }
-    lua_pushvalue(L(), -2);
 
-    // parameters...
-    PushParameters(pars...);
+template<typename T, class ...P> inline T 
+LuaInterface::CallMethod(CStringRef method, P&&... pars) const
+{
+    CallMethodN(ResultCount<T>::value, method, forward<P>(pars)...);
+    return Pop<T>();
+}
 
-    // stack:                             obj fct obj [parameters]
-    Call(sizeof...(P)+1, 1);
 
-    assert(StackSize() == s+1);
+template<int&... NoResultType, class ...P> inline void
+LuaInterface::CallFunctionInStack(P&&... pars) const
+{
+    CallFunctionInStackN(1, forward<P>(pars)...);
 }
 
 
-template<class ...P> inline void 
-LuaInterface::CallVoidMethod(string const& method, P... pars) const
+template<typename T, class ...P> inline T
+LuaInterface::CallFunctionInStack(P&&... pars) const
 {
-    int s = StackSize();
+    CallFunctionInStackN(ResultCount<T>::value, forward<P>(pars)...);
+    return Pop<T>();
+}
 
-    lua_getfield(L(), -1, method.c_str());
-    if(lua_isnil(L(), -1)) {
-        Error("Method `" + method + "` not found.");
+
+template<int&... NoResultType, class ...P> inline void 
+LuaInterface::CallGlobalFunction(CStringRef f, P&&... pars) const 
+{
+    CallGlobalFunctionN(1, f, forward<P>(pars)...);
+}
+
+
+template<typename T, class ...P> inline T
+LuaInterface::CallGlobalFunction(CStringRef f, P&&... pars) const
+{
+    CallGlobalFunctionN(ResultCount<T>::value, f, forward<P>(pars)...);
+    return Pop<T>();
+}
+
+
+template<typename T, class ...P> inline T
+LuaInterface::CallPureFunction(CStringRef f, P&&... pars) const
+{
+    static_assert(!is_pointer<T>::value, "pure functions can't return pointers (they may dangle)");
+    if(memo.Capacity() == 0) {
+        return CallGlobalFunction<T>(f, forward<P>(pars)...);
     }
-    lua_pushvalue(L(), -2);
 
-    // parameters...
-    PushParameters(pars...);
+    string key = MemoCache::Key<T>(f.c_str(), pars...);
+    if(T const* value = memo.Find<T>(key)) {
+        return *value;
+    }
+    int status = CallGlobalFunctionN(ResultCount<T>::value, f, forward<P>(pars)...);
+    T value = Pop<T>();
+    if(status == LUA_OK) {
+        memo.Insert<T>(move(key), value);
+    }
+    return value;
+}
 
-    // stack:                             obj fct obj [parameters]
-    Call(sizeof...(P)+1, 0);
 
-    assert(StackSize() == s);
+/*
+ * events
+ */
+
+template<class ...P> inline void
+LuaInterface::Emit(CStringRef event, P&&... pars) const
+{
+    PushParameters(forward<P>(pars)...);
+    DispatchEvent(event.c_str(), sizeof...(P));
 }
 
 
-template<typename T, class ...P> inline T 
-LuaInterface::CallMethod(string const& method, P... pars) const
+template<class ...P> inline void
+LuaInterface::Post(CStringRef event, P&&... pars) const
 {
-    CallMethod(method, pars...);
-    return Pop<T>();
+    PushParameters(forward<P>(pars)...);
+    QueueEvent(event.c_str(), sizeof...(P), false);
 }
 
 
 template<class ...P> inline void
-LuaInterface::CallFunctionInStack(P... pars) const
+LuaInterface::PostCoalesced(CStringRef event, P&&... pars) const
 {
-    int s = StackSize();
+    PushParameters(forward<P>(pars)...);
+    QueueEvent(event.c_str(), sizeof...(P), true);
+}
 
-    if(!lua_isfunction(L(), -1)) {
-        Error("Stacked value not a function.");
-    }
 
-    // parameters...
-    PushParameters(pars...);
+/*
+ * calls from other threads
+ */
 
-    // stack:                             obj fct obj [parameters]
-    Call(sizeof...(P), 1);
+template<class F> inline auto
+LuaInterface::Submit(F f) const -> future<decltype(f(*this))>
+{
+    typedef decltype(f(*this)) T;
+    auto p = make_shared<promise<T>>();
+    future<T> result = p->get_future();
+    commands.Push([this, p, f]() {
+        Fulfill(*p, [&]() { return f(*this); });
+    });
+    return result;
+}
 
-    assert(StackSize() == s+1-1);
+
+template<typename T, class ...P> inline future<T>
+LuaInterface::SubmitCall(string const& f, P&&... pars) const
+{
+    tuple<typename StoredArg<typename decay<P>::type>::type...> args(forward<P>(pars)...);
+    return Submit([f, args](LuaInterface const& lua) -> T {
+        return lua.CallStored<T>(f, args, index_sequence_for<P...>());
+    });
 }
 
 
-template<typename T, class ...P> inline T
-LuaInterface::CallFunctionInStack(P... pars) const
+template<typename T> inline future<T>
+LuaInterface::SubmitDo(string const& code) const
 {
-    CallFunctionInStack(pars...);
-    return Pop<T>();
+    return Submit([code](LuaInterface const& lua) -> T {
+        return lua.DoStored<T>(code);
+    });
 }
 
 
-template<class ...P> inline void 
-LuaInterface::CallGlobalFunction(string const& f, P... pars) const 
+template<typename T, class Tuple, size_t... I> inline typename enable_if<!is_void<T>::value, T>::type
+LuaInterface::CallStored(string const& f, Tuple const& args, index_sequence<I...>) const
 {
-    int s = StackSize();
+    return CallGlobalFunction<T>(f, std::get<I>(args)...);
+}
 
-    lua_getglobal(L(), f.c_str());
-    if(lua_isnil(L(), -1)) {
-        Error("Function `" + f + "` not found.");
-    }
 
-    // parameters...
-    PushParameters(pars...);
+template<typename T, class Tuple, size_t... I> inline typename enable_if<is_void<T>::value>::type
+LuaInterface::CallStored(string const& f, Tuple const& args, index_sequence<I...>) const
+{
+    CallGlobalFunction(f, std::get<I>(args)...);
+}
 
-    // stack:                             obj fct obj [parameters]
-    Call(sizeof...(P), 1);
 
-    assert(StackSize() == s+1);
+template<typename T, class F> inline void
+LuaInterface::Fulfill(promise<T>& p, F&& f)
+{
+    try {
+        p.set_value(f());
+    } catch(...) {
+        p.set_exception(current_exception());
+    }
 }
 
 
-template<typename T, class ...P> inline T
-LuaInterface::CallGlobalFunction(string const& f, P... pars) const
+template<class F> inline void
+LuaInterface::Fulfill(promise<void>& p, F&& f)
 {
-    CallGlobalFunction(f, pars...);
-    return Pop<T>();
+    try {
+        f();
+        p.set_value();
+    } catch(...) {
+        p.set_exception(current_exception());
+    }
 }
 
 
@@ -308,6 +441,7 @@ template<typename T> inline T
 LuaInterface::Do(string const& code) const 
 {
     int s = StackSize();
+    RecordScope record(recorder, L(), Recorder::DO, code.c_str(), 0);
 
     int r = luaL_loadstring(L(), code.c_str());
     if(r == LUA_ERRSYNTAX) {
@@ -315,7 +449,9 @@ LuaInterface::Do(string const& code) const
     } else if(r == LUA_ERRFILE) {
         Error("error loading immediate command");
     }
-    Call(0, 1);
+    int status = Call(0, ResultCount<T>::value);
+    record.Results(status, status == LUA_OK ? ResultCount<T>::value : 1);
+    NormalizeResults(status, ResultCount<T>::value);
     auto t = Pop<T>();
 
     assert(StackSize() == s);
@@ -327,13 +463,17 @@ LuaInterface::Do(string const& code) const
 inline void 
 LuaInterface::Do(string const& code) const 
 {
+    int s = StackSize();
+    RecordScope record(recorder, L(), Recorder::DO, code.c_str(), 0);
+
     int r = luaL_loadstring(L(), code.c_str());
     if(r == LUA_ERRSYNTAX) {
         Error("syntax error in immediate command");
     } else if(r == LUA_ERRFILE) {
         Error("error loading immediate command");
     }
-    Call(0, LUA_MULTRET);
+    int status = Call(0, LUA_MULTRET);
+    record.Results(status, status == LUA_OK ? StackSize() - s : 1);
 }
 
 
@@ -380,17 +520,139 @@ LuaInterface::RegisterConstructor(String... pars) const
 }
 
 
+/*
+ * parallel kernels
+ */
+
+// `f` maps an In to an Out (any types supported by Get/Push: numbers, Point,
+// pointers to userdata). The array is marshalled once, `f` runs over it in the
+// thread pool, and the results are written back to a table.
+template<typename In, typename Out, typename F> inline void
+LuaInterface::RegisterKernel(string const& name, F f) const
+{
+    kernels[name] = [this, f](int t, int out) {
+        int s = StackSize();
+
+        size_t n = lua_rawlen(L(), t);
+        vector<In> in;
+        in.reserve(n);
+        for(size_t i=0; i<n; ++i) {
+            lua_rawgeti(L(), t, i+1);
+            in.push_back(Get<In>());
+            lua_pop(L(), 1);
+        }
+
+        unique_ptr<Out[]> result(new Out[n]);   // not a vector, that could be vector<bool>
+        ThreadPool::Shared().ParallelFor(n, [&](size_t begin, size_t end) {
+            for(size_t i=begin; i<end; ++i) {
+                result[i] = f(in[i]);
+            }
+        });
+
+        if(out) {
+            lua_pushvalue(L(), out);
+        } else {
+            lua_createtable(L(), static_cast<int>(n), 0);
+        }
+        for(size_t i=0; i<n; ++i) {
+            Push(result[i]);
+            lua_rawseti(L(), -2, i+1);
+        }
+
+        assert(StackSize() == s+1);
+    };
+}
+
+
 
 /*
  * private templates
  */
 
+template<class T, size_t... I> inline T
+LuaInterface::GetTuple(int first, index_sequence<I...>) const
+{
+    return T(Get<typename tuple_element<I, T>::type>(first + static_cast<int>(I))...);
+}
+
+
+// the calls leave exactly `nresults` values on the stack
+
+template<class ...P> inline void 
+LuaInterface::CallMethodN(int nresults, CStringRef method, P&&... pars) const 
+{
+    int s = StackSize();
+    TraceScope trace(tracer, "method", method.c_str());
+
+    lua_getfield(L(), -1, method.c_str());
+    if(lua_isnil(L(), -1)) {
+        Error(string("Method `") + method.c_str() + "` not found.");
+    }
+    lua_pushvalue(L(), -2);
+
+    // parameters...
+    PushParameters(forward<P>(pars)...);
+
+    // stack:                             obj fct obj [parameters]
+    RecordScope record(recorder, L(), Recorder::METHOD, method.c_str(), sizeof...(P)+1);
+    int status = Call(sizeof...(P)+1, nresults);
+    record.Results(status, status == LUA_OK ? nresults : 1);
+    NormalizeResults(status, nresults);
+
+    assert(StackSize() == s+nresults);
+}
+
+
+template<class ...P> inline void
+LuaInterface::CallFunctionInStackN(int nresults, P&&... pars) const
+{
+    int s = StackSize();
+
+    if(!lua_isfunction(L(), -1)) {
+        Error("Stacked value not a function.");
+    }
+
+    // parameters...
+    PushParameters(forward<P>(pars)...);
+
+    // stack:                             fct [parameters]
+    NormalizeResults(Call(sizeof...(P), nresults), nresults);
+
+    assert(StackSize() == s-1+nresults);
+}
+
+
+template<class ...P> inline int
+LuaInterface::CallGlobalFunctionN(int nresults, CStringRef f, P&&... pars) const 
+{
+    int s = StackSize();
+    TraceScope trace(tracer, "function", f.c_str());
+
+    lua_getglobal(L(), f.c_str());
+    if(lua_isnil(L(), -1)) {
+        Error(string("Function `") + f.c_str() + "` not found.");
+    }
+
+    // parameters...
+    PushParameters(forward<P>(pars)...);
+
+    // stack:                             fct [parameters]
+    RecordScope record(recorder, L(), Recorder::CALL, f.c_str(), sizeof...(P));
+    int status = Call(sizeof...(P), nresults);
+    record.Results(status, status == LUA_OK ? nresults : 1);
+    NormalizeResults(status, nresults);
+
+    assert(StackSize() == s+nresults);
+    return status;
+}
+
+
 
 template<class Arg1, class... Args> inline void 
-LuaInterface::PushParameters(const Arg1& arg1, const Args&... args) const 
+LuaInterface::PushParameters(Arg1&& arg1, Args&&... args) const 
 {
-    Push(arg1);
-    PushParameters(args...);
+    Push(forward<Arg1>(arg1));
+    PushParameters(forward<Args>(args)...);
 }
 inline void LuaInterface::PushParameters() const {}
 
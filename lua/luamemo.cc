@@ -0,0 +1,148 @@
+#include "luamemo.h"
+
+#include <cstring>
+
+#include "luainterface.h"
+
+namespace lua {
+
+/*
+ * memo cache
+ */
+
+MemoCache::Value*
+MemoCache::FindEntry(string const& key)
+{
+    auto it = index.find(key);
+    if(it == index.end()) {
+        ++stats.misses;
+        return nullptr;
+    }
+    ++stats.hits;
+    entries.splice(entries.begin(), entries, it->second);
+    return it->second->second.get();
+}
+
+
+void
+MemoCache::InsertEntry(string key, unique_ptr<Value> value)
+{
+    if(capacity == 0) {
+        return;
+    }
+    auto it = index.find(key);
+    if(it != index.end()) {
+        it->second->second = move(value);
+        entries.splice(entries.begin(), entries, it->second);
+        return;
+    }
+    while(index.size() >= capacity) {
+        index.erase(entries.back().first);
+        entries.pop_back();
+        ++stats.evictions;
+    }
+    entries.emplace_front(move(key), move(value));
+    index.emplace(entries.front().first, entries.begin());
+}
+
+
+void
+MemoCache::Invalidate()
+{
+    stats.invalidations += index.size();
+    index.clear();
+    entries.clear();
+}
+
+
+// the results of one function (the key starts with its name and a NUL)
+void
+MemoCache::Invalidate(const char* f)
+{
+    size_t len = strlen(f) + 1;
+    for(auto it = entries.begin(); it != entries.end(); ) {
+        if(it->first.compare(0, len, f, len) == 0) {
+            index.erase(it->first);
+            it = entries.erase(it);
+            ++stats.invalidations;
+        } else {
+            ++it;
+        }
+    }
+}
+
+
+void
+MemoCache::SetCapacity(size_t n)
+{
+    capacity = n;
+    while(index.size() > capacity) {
+        index.erase(entries.back().first);
+        entries.pop_back();
+        ++stats.evictions;
+    }
+}
+
+
+void
+MemoCache::Append(string& key, double d)
+{
+    key.push_back('n');
+    key.append(reinterpret_cast<const char*>(&d), sizeof d);
+}
+
+
+void
+MemoCache::Append(string& key, const char* s, size_t len)
+{
+    uint32_t n = static_cast<uint32_t>(len);
+    key.push_back('s');
+    key.append(reinterpret_cast<const char*>(&n), sizeof n);
+    key.append(s, len);
+}
+
+
+void
+MemoCache::Append(string& key, const char* s)
+{
+    Append(key, s, strlen(s));
+}
+
+
+void
+MemoCache::Append(string& key, Point const& p)
+{
+    key.push_back('p');
+    key.append(reinterpret_cast<const char*>(&p.x), sizeof p.x);
+    key.append(reinterpret_cast<const char*>(&p.y), sizeof p.y);
+}
+
+
+/*
+ * LuaInterface
+ */
+
+void
+LuaInterface::SetPureCacheSize(size_t max_entries) const
+{
+    memo.SetCapacity(max_entries);
+}
+
+
+void
+LuaInterface::InvalidatePure() const
+{
+    memo.Invalidate();
+}
+
+
+void
+LuaInterface::InvalidatePure(CStringRef f) const
+{
+    memo.Invalidate(f.c_str());
+}
+
+
+}  // namespace lua
+
+// vim: ts=4:sw=4:sts=4:expandtab
@@ -0,0 +1,145 @@
+#ifndef LUA_LUAMEMO_H_
+#define LUA_LUAMEMO_H_
+
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <string>
+#include <type_traits>
+#include <unordered_map>
+#include <vector>
+using namespace std;
+
+#include "point.h"
+
+namespace lua {
+
+struct MemoStats {
+    size_t hits          = 0;    // calls served from the cache
+    size_t misses        = 0;    // calls into Lua
+    size_t evictions     = 0;    // least recently used results dropped
+    size_t invalidations = 0;    // results dropped by InvalidatePure (or a reload)
+};
+
+// results of pure functions, as C++ values, keyed by the function, the result
+// type and the arguments, marshalled into a string. Bounded, least recently
+// used first out.
+class MemoCache {
+public:
+    // the key of a call (arguments: numbers, bool, strings, Point, vectors; pointers
+    // other than C strings don't compile, since the address says nothing of the value)
+    template<class T, class ...P> static string Key(const char* f, P const&... pars);
+
+    template<class T> T const* Find(string const& key);
+    template<class T> void Insert(string key, T const& value);
+
+    void Invalidate();
+    void Invalidate(const char* f);
+    void SetCapacity(size_t n);
+    size_t Capacity() const { return capacity; }
+    size_t Size() const { return index.size(); }
+
+    MemoStats stats;
+
+private:
+    struct Value {
+        virtual ~Value() {}
+    };
+    template<class T> struct ValueOf : Value {
+        explicit ValueOf(T const& v) : v(v) {}
+        T v;
+    };
+    template<class T> struct TypeTag { static const char id; };   // identifies T in the keys
+    typedef list<pair<string, unique_ptr<Value>>> Entries;
+
+    Value* FindEntry(string const& key);
+    void InsertEntry(string key, unique_ptr<Value> value);
+
+    static void Append(string& key, double d);
+    static void Append(string& key, const char* s, size_t len);
+    static void Append(string& key, string const& s) { Append(key, s.data(), s.size()); }
+    static void Append(string& key, const char* s);
+    static void Append(string& key, char* s) { Append(key, static_cast<const char*>(s)); }
+    static void Append(string& key, Point const& p);
+    template<class N> static typename enable_if<is_integral<N>::value>::type Append(string& key, N n);
+    template<class U> static void Append(string& key, U* ptr);
+    template<class U> static void Append(string& key, vector<U> const& v);
+    static void AppendAll(string&) {}
+    template<class A, class ...P> static void AppendAll(string& key, A const& a, P const&... pars);
+
+    size_t                                    capacity = 1024;
+    Entries                                   entries;     // most recently used first
+    unordered_map<string, Entries::iterator>  index;
+};
+
+
+template<class T> const char MemoCache::TypeTag<T>::id = 0;
+
+
+template<class T, class ...P> inline string
+MemoCache::Key(const char* f, P const&... pars)
+{
+    string key = f;
+    key.push_back('\0');
+    const char* tag = &TypeTag<T>::id;
+    key.append(reinterpret_cast<const char*>(&tag), sizeof tag);
+    AppendAll(key, pars...);
+    return key;
+}
+
+
+template<class T> inline T const*
+MemoCache::Find(string const& key)
+{
+    Value* v = FindEntry(key);
+    return v ? &static_cast<ValueOf<T>*>(v)->v : nullptr;
+}
+
+
+template<class T> inline void
+MemoCache::Insert(string key, T const& value)
+{
+    InsertEntry(move(key), unique_ptr<Value>(new ValueOf<T>(value)));
+}
+
+
+template<class N> inline typename enable_if<is_integral<N>::value>::type
+MemoCache::Append(string& key, N n)
+{
+    int64_t v = static_cast<int64_t>(n);
+    key.push_back('i');
+    key.append(reinterpret_cast<const char*>(&v), sizeof v);
+}
+
+
+template<class U> inline void
+MemoCache::Append(string&, U*)
+{
+    static_assert(sizeof(U) == 0, "pure functions can't take pointers (other than C strings)");
+}
+
+
+template<class U> inline void
+MemoCache::Append(string& key, vector<U> const& v)
+{
+    uint32_t n = static_cast<uint32_t>(v.size());
+    key.push_back('v');
+    key.append(reinterpret_cast<const char*>(&n), sizeof n);
+    for(auto const& e: v) {
+        Append(key, e);
+    }
+}
+
+
+template<class A, class ...P> inline void
+MemoCache::AppendAll(string& key, A const& a, P const&... pars)
+{
+    Append(key, a);
+    AppendAll(key, pars...);
+}
+
+}  // namespace lua
+
+#endif  // LUA_LUAMEMO_H_
+
+// vim: ts=4:sw=4:sts=4:expandtab
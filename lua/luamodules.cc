@@ -0,0 +1,376 @@
+#include "luamodules.h"
+
+extern "C" {
+    #include <lua.h>
+    #include <lauxlib.h>
+    #include <lualib.h>
+}
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#ifdef __linux__
+#  include <sys/inotify.h>
+#endif
+
+#include <cassert>
+#include <cerrno>
+#include <cstring>
+
+#include "luahelper.h"
+#include "luainterface.h"
+
+namespace lua {
+
+/*
+ * bundles
+ */
+
+namespace {
+
+uint32_t
+read_u32(const char* p)
+{
+    auto b = reinterpret_cast<const unsigned char*>(p);
+    return b[0] | (b[1] << 8) | (b[2] << 16) | (static_cast<uint32_t>(b[3]) << 24);
+}
+
+
+uint32_t
+adler32(const char* data, size_t len)
+{
+    uint32_t a = 1, b = 0;
+    for(size_t i=0; i<len; ++i) {
+        a = (a + static_cast<unsigned char>(data[i])) % 65521;
+        b = (b + a) % 65521;
+    }
+    return (b << 16) | a;
+}
+
+}  // anonymous namespace
+
+
+unique_ptr<Bundle>
+Bundle::Open(string const& filename, string& error)
+{
+    unique_ptr<Bundle> bundle(new Bundle());
+    bundle->filename = filename;
+
+    int fd = open(filename.c_str(), O_RDONLY);
+    if(fd < 0) {
+        error = strerror(errno);
+        return nullptr;
+    }
+    struct stat st;
+    if(fstat(fd, &st) != 0 || st.st_size < 16) {
+        close(fd);
+        error = "not a bundle";
+        return nullptr;
+    }
+    void* data = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(data == MAP_FAILED) {
+        error = strerror(errno);
+        return nullptr;
+    }
+    bundle->data = reinterpret_cast<const char*>(data);
+    bundle->size = st.st_size;
+
+    const char* p = bundle->data;
+    if(memcmp(p, "LUAXBNDL", 8) != 0 || read_u32(p + 8) != 1) {
+        error = "not a bundle, or unsupported version";
+        return nullptr;
+    }
+    uint32_t count = read_u32(p + 12);
+    if(16 + static_cast<size_t>(count) * 20 > bundle->size) {
+        error = "truncated index";
+        return nullptr;
+    }
+    bundle->modules.reserve(count);
+    for(uint32_t i=0; i<count; ++i) {
+        const char* e = p + 16 + i * 20;
+        size_t name_offset = read_u32(e),      name_len = read_u32(e + 4),
+               data_offset = read_u32(e + 8),  data_len = read_u32(e + 12);
+        if(name_offset + name_len > bundle->size || data_offset + data_len > bundle->size) {
+            error = "truncated module";
+            return nullptr;
+        }
+        bundle->modules.emplace(string(p + name_offset, name_len),
+                Module { p + data_offset, data_len, read_u32(e + 16), false });
+    }
+    return bundle;
+}
+
+
+Bundle::~Bundle()
+{
+    if(data) {
+        munmap(const_cast<char*>(data), size);
+    }
+}
+
+
+// module by name; the checksum is verified the first time the module is found
+// (on a mismatch, nullptr is returned and `corrupt` is set)
+Bundle::Module*
+Bundle::Find(string const& name, bool& corrupt)
+{
+    corrupt = false;
+    auto it = modules.find(name);
+    if(it == modules.end()) {
+        return nullptr;
+    }
+    Module& m = it->second;
+    if(!m.verified) {
+        if(adler32(m.code, m.len) != m.checksum) {
+            corrupt = true;
+            return nullptr;
+        }
+        m.verified = true;
+    }
+    return &m;
+}
+
+
+/*
+ * module resolver
+ */
+
+ModuleResolver::~ModuleResolver()
+{
+    if(inotify_fd >= 0) {
+        close(inotify_fd);
+    }
+}
+
+
+// the directory contains the file? (directories are read once, and then cached)
+bool
+ModuleResolver::Listed(string const& dir, string const& file)
+{
+    auto it = dirs.find(dir);
+    if(it == dirs.end()) {
+        unordered_set<string> files;
+        if(DIR* d = opendir(dir.empty() ? "." : dir.c_str())) {
+            while(struct dirent* e = readdir(d)) {
+                files.insert(e->d_name);
+            }
+            closedir(d);
+        }
+#ifdef __linux__
+        if(inotify_fd >= 0) {
+            int wd = inotify_add_watch(inotify_fd, dir.empty() ? "." : dir.c_str(),
+                    IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO);
+            if(wd >= 0) {
+                watches[wd] = dir;
+            }
+        }
+#endif
+        it = dirs.emplace(dir, move(files)).first;
+    }
+    return it->second.count(file) > 0;
+}
+
+
+// drop the listings of the directories that changed
+void
+ModuleResolver::Poll()
+{
+#ifdef __linux__
+    if(inotify_fd < 0) {
+        return;
+    }
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    ssize_t len;
+    while((len = read(inotify_fd, buf, sizeof buf)) > 0) {
+        for(char* p = buf; p < buf + len; ) {
+            auto e = reinterpret_cast<struct inotify_event*>(p);
+            auto it = watches.find(e->wd);
+            if(it != watches.end()) {
+                dirs.erase(it->second);
+                resolved.clear();
+            }
+            p += sizeof(struct inotify_event) + e->len;
+        }
+    }
+#endif
+}
+
+
+string const*
+ModuleResolver::Find(string const& current_path, string const& name)
+{
+    Poll();
+    if(current_path != path) {
+        path = current_path;
+        resolved.clear();
+    }
+
+    auto it = resolved.find(name);
+    if(it != resolved.end()) {
+        return &it->second;
+    }
+
+    string subpath = name;
+    for(char& c: subpath) {
+        if(c == '.') {
+            c = '/';
+        }
+    }
+
+    size_t start = 0;
+    while(start <= path.size()) {
+        size_t end = path.find(';', start);
+        if(end == string::npos) {
+            end = path.size();
+        }
+        string tmpl = path.substr(start, end - start);
+        start = end + 1;
+
+        size_t q = tmpl.find('?');
+        if(q == string::npos) {
+            continue;
+        }
+        string file = tmpl.substr(0, q) + subpath + tmpl.substr(q + 1);
+        size_t slash = file.rfind('/');
+        string dir = (slash == string::npos) ? "" : file.substr(0, slash);
+        if(Listed(dir, file.substr(slash == string::npos ? 0 : slash + 1))) {
+            return &resolved.emplace(name, file).first->second;
+        }
+    }
+    return nullptr;
+}
+
+
+void
+ModuleResolver::Watch(bool watch)
+{
+#ifdef __linux__
+    if(watch && inotify_fd < 0) {
+        inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        dirs.clear();          // list again, so that the directories are watched
+        resolved.clear();
+    } else if(!watch && inotify_fd >= 0) {
+        close(inotify_fd);
+        inotify_fd = -1;
+        watches.clear();
+    }
+#else
+    (void) watch;
+#endif
+}
+
+
+/*
+ * LuaInterface
+ */
+
+void
+LuaInterface::SetModulePath(string const& path) const
+{
+    int s = StackSize();
+
+    // as Lua does with LUA_PATH: every ";;" is the default path
+    string p, def = ";" + modules.default_path + ";";
+    size_t start = 0;
+    for(size_t dd; (dd = path.find(";;", start)) != string::npos; start = dd + 2) {
+        p.append(path, start, dd - start).append(def);
+    }
+    p.append(path, start, string::npos);
+
+    lua_getglobal(L(), "package");
+    lua_pushstring(L(), p.c_str());
+    lua_setfield(L(), -2, "path");
+    Pop();
+
+    assert(StackSize() == s);
+}
+
+
+void
+LuaInterface::WatchModules(bool watch) const
+{
+    modules.Watch(watch);
+}
+
+
+void
+LuaInterface::LoadBundle(string const& filename) const
+{
+    string error;
+    unique_ptr<Bundle> bundle = Bundle::Open(filename, error);
+    if(!bundle) {
+        Error("Could not load bundle " + filename + ": " + error);
+        return;
+    }
+    modules.bundles.push_back(move(bundle));
+}
+
+
+void initialize_modules(LuaInterface const& luax)
+{
+    lua_State* L = luax.L();
+
+    lua_getglobal(L, "package");
+    lua_getfield(L, -1, "path");
+    luax.modules.default_path = lua_tostring(L, -1);
+    lua_pop(L, 1);
+
+    // replace the Lua file searcher (the second one) with the bundle and path searcher
+    lua_getfield(L, -1, LUAX_SEARCHERS);
+    lua_pushcfunction(L, [](lua_State* L) {
+        const char* name = luaL_checkstring(L, 1);
+        ModuleResolver& modules = LuaInterface::get(L).modules;
+
+        // bundles: loaded straight from the mapping
+        for(auto const& bundle: modules.bundles) {
+            bool corrupt;
+            Bundle::Module* m = bundle->Find(name, corrupt);
+            if(corrupt) {
+                return luaL_error(L, "module '%s' in bundle '%s' is corrupt (checksum mismatch)",
+                        name, bundle->Filename().c_str());
+            }
+            if(!m) {
+                continue;
+            }
+            Bundle::Module chunk = *m;
+            int r = lua_load(L, [](lua_State*, void* ud, size_t* size) -> const char* {
+                auto c = reinterpret_cast<Bundle::Module*>(ud);
+                *size = c->len;
+                c->len = 0;
+                return *size ? c->code : nullptr;
+            }, &chunk, name, "b");
+            if(r != LUA_OK) {
+                return luaL_error(L, "error loading module '%s' from bundle '%s':\n\t%s",
+                        name, bundle->Filename().c_str(), lua_tostring(L, -1));
+            }
+            lua_pushstring(L, bundle->Filename().c_str());
+            return 2;
+        }
+
+        // package.path
+        lua_getglobal(L, "package");
+        lua_getfield(L, -1, "path");
+        const char* path = lua_tostring(L, -1);
+        string const* file = modules.Find(path ? path : "", name);
+        if(!file) {
+            lua_pushfstring(L, "\n\tno file for '%s' in package.path", name);
+            return 1;
+        }
+        if(luaL_loadfile(L, file->c_str()) != LUA_OK) {
+            return luaL_error(L, "error loading module '%s' from file '%s':\n\t%s",
+                    name, file->c_str(), lua_tostring(L, -1));
+        }
+        lua_pushstring(L, file->c_str());
+        return 2;
+    });
+    lua_rawseti(L, -2, 2);
+    lua_pop(L, 2);
+}
+
+
+}  // namespace lua
+
+// vim: ts=4:sw=4:sts=4:expandtab
@@ -0,0 +1,75 @@
+#ifndef LUA_LUAMODULES_H_
+#define LUA_LUAMODULES_H_
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+using namespace std;
+
+namespace lua {
+
+// precompiled modules packed in a single file (see mkbundle.lua), mapped in memory
+class Bundle {
+public:
+    struct Module {
+        const char* code;
+        size_t      len;
+        uint32_t    checksum;
+        bool        verified;
+    };
+
+    static unique_ptr<Bundle> Open(string const& filename, string& error);
+    ~Bundle();
+
+    Module* Find(string const& name, bool& corrupt);
+    string const& Filename() const { return filename; }
+
+private:
+    Bundle() {}
+
+    string                         filename;
+    const char*                    data = nullptr;
+    size_t                         size = 0;
+    unordered_map<string, Module>  modules;
+
+    Bundle(Bundle const&) = delete;
+    Bundle& operator=(Bundle const&) = delete;
+};
+
+
+// resolves `require` names through the mounted bundles and the templates of
+// package.path, using cached directory listings instead of probing each
+// candidate file
+class ModuleResolver {
+public:
+    ModuleResolver() {}
+    ~ModuleResolver();
+
+    string const* Find(string const& path, string const& name);
+    void Watch(bool watch);
+
+    string default_path;
+    vector<unique_ptr<Bundle>> bundles;   // searched before package.path
+
+private:
+    bool Listed(string const& dir, string const& file);
+    void Poll();
+
+    string                                       path;       // package.path of the cached results
+    unordered_map<string, string>                resolved;   // module name -> file
+    unordered_map<string, unordered_set<string>> dirs;       // directory -> files
+    int                                          inotify_fd = -1;
+    unordered_map<int, string>                   watches;    // watch descriptor -> directory
+
+    ModuleResolver(ModuleResolver const&) = delete;
+    ModuleResolver& operator=(ModuleResolver const&) = delete;
+};
+
+}  // namespace lua
+
+#endif  // LUA_LUAMODULES_H_
+
+// vim: ts=4:sw=4:sts=4:expandtab
@@ -0,0 +1,185 @@
+#include "luainterface.h"
+#include "mylib.h"
+
+extern "C" {
+    #include <lua.h>
+    #include <lauxlib.h>
+    #include <lualib.h>
+}
+
+#include <algorithm>
+#include <cassert>
+
+/*
+ * The mylib modules are registered in `package.preload`, and only executed
+ * when they are required, or when one of the globals they define is first
+ * accessed (through the `__index` of the global table).
+ */
+
+namespace lua {
+
+namespace {
+
+// package.preload loader: upvalue 1 is the MylibModule
+int
+load_module(lua_State* L)
+{
+    auto m = reinterpret_cast<MylibModule const*>(lua_touserdata(L, lua_upvalueindex(1)));
+    if(luaL_loadbuffer(L, reinterpret_cast<const char*>(m->code), m->len, m->name) != LUA_OK) {
+        return lua_error(L);
+    }
+    lua_call(L, 0, 1);
+    return 1;
+}
+
+
+// _G.__index: upvalue 1 maps global names to the module that defines them
+int
+lazy_global(lua_State* L)
+{
+    lua_pushvalue(L, 2);
+    lua_rawget(L, lua_upvalueindex(1));       // module (false: declared with `global`)
+    if(lua_type(L, -1) != LUA_TSTRING) {
+        lua_pushnil(L);
+        return 1;
+    }
+
+    // forget every global of this module, and require it
+    const char* module = lua_tostring(L, -1);
+    lua_pushnil(L);
+    while(lua_next(L, lua_upvalueindex(1))) {
+        if(lua_rawequal(L, -1, -3)) {
+            lua_pushvalue(L, -2);
+            lua_pushnil(L);
+            lua_rawset(L, lua_upvalueindex(1));
+        }
+        lua_pop(L, 1);
+    }
+    lua_getglobal(L, "require");
+    lua_pushstring(L, module);
+    lua_call(L, 1, 0);
+
+    lua_settop(L, 2);
+    lua_rawget(L, 1);
+    return 1;
+}
+
+
+// global(name, ...): declares globals, for strict.lua and for the static check
+// of the chunks loaded later (see luastrict.cc). Upvalue 1 is the table of
+// lazy globals, where the names are kept (as `false`).
+int
+declare_globals(lua_State* L)
+{
+    int n = lua_gettop(L);
+    for(int i=1; i<=n; ++i) {
+        const char* name = luaL_checkstring(L, i);
+        lua_pushvalue(L, lua_upvalueindex(1));
+        lua_getfield(L, -1, name);
+        if(lua_isnil(L, -1)) {
+            lua_pushboolean(L, false);
+            lua_setfield(L, -3, name);
+        }
+        lua_pop(L, 2);
+    }
+
+    lua_pushglobaltable(L);
+    if(lua_getmetatable(L, -1)) {
+        lua_getfield(L, -1, "__declared");      // (strict.lua, DEBUG)
+        if(lua_istable(L, -1)) {
+            for(int i=1; i<=n; ++i) {
+                lua_pushboolean(L, true);
+                lua_setfield(L, -2, lua_tostring(L, i));
+            }
+        }
+    }
+    return 0;
+}
+
+}  // anonymous namespace
+
+
+void
+LuaInterface::LoadMylib(MylibOptions const& opt) const
+{
+    int s = StackSize();
+
+    auto selected = [&](string const& name) {
+        return opt.modules.empty() || find(begin(opt.modules), end(opt.modules), name) != end(opt.modules);
+    };
+
+    lua_getglobal(L(), "package");
+    lua_getfield(L(), -1, "preload");
+    lua_newtable(L());                                  // package preload lazy
+    for(auto const& m: mylib_modules) {
+        if(!selected(m.name)) {
+            continue;
+        }
+        lua_pushlightuserdata(L(), const_cast<MylibModule*>(&m));
+        lua_pushcclosure(L(), load_module, 1);
+        lua_setfield(L(), -3, m.name);
+        for(auto g = m.globals; *g; ++g) {
+            lua_pushstring(L(), m.name);
+            lua_setfield(L(), -2, *g);
+        }
+    }
+
+    lua_pushvalue(L(), -1);
+    lua_setfield(L(), LUA_REGISTRYINDEX, "mylib.lazy_globals");
+
+    lua_pushglobaltable(L());                           // package preload lazy _G
+    if(!lua_getmetatable(L(), -1)) {
+        lua_newtable(L());
+        lua_pushvalue(L(), -1);
+        lua_setmetatable(L(), -3);
+    }                                                   // package preload lazy _G mt
+    lua_pushvalue(L(), -3);
+    lua_pushcclosure(L(), lazy_global, 1);
+    lua_setfield(L(), -2, "__index");
+    lua_pushstring(L(), "global");
+    lua_pushvalue(L(), -4);
+    lua_pushcclosure(L(), declare_globals, 1);
+    lua_rawset(L(), -4);                                // (with or without DEBUG)
+    lua_pop(L(), 5);
+
+    assert(StackSize() == s);
+
+    // strict.lua leaves the global table alone, globals are checked when loading (see luastrict.cc)
+    static_strict = opt.static_strict;
+#if LUA_VERSION_NUM != 503
+    if(static_strict) {
+        static_strict = false;      // (strict.lua checks at runtime instead)
+        Error("static_strict: only the bytecode of Lua 5.3 can be checked");
+    }
+#endif
+    if(static_strict) {
+        lua_pushboolean(L(), true);
+        lua_setglobal(L(), "__STATIC_STRICT");
+    }
+
+    for(auto const& name: opt.eager) {
+        if(selected(name)) {
+            Require(name);
+        }
+    }
+}
+
+
+void
+LuaInterface::Require(string const& module) const
+{
+    int s = StackSize();
+
+    lua_getglobal(L(), "require");
+    lua_pushstring(L(), module.c_str());
+    if(Call(1, 0) != LUA_OK) {
+        Pop();      // error message (already reported by Traceback)
+    }
+
+    assert(StackSize() == s);
+}
+
+
+}  // namespace lua
+
+// vim: ts=4:sw=4:sts=4:expandtab
@@ -0,0 +1,224 @@
+#include "luaparallel.h"
+
+extern "C" {
+    #include <lua.h>
+    #include <lauxlib.h>
+    #include <lualib.h>
+}
+
+#include <algorithm>
+
+#include "luahelper.h"
+#include "luainterface.h"
+
+namespace lua {
+
+/*
+ * thread pool
+ */
+
+namespace {
+
+thread_local int loop_depth = 0;       // loops this thread is running chunks of
+
+// counts the loop for the scope
+struct InLoop {
+    InLoop() { ++loop_depth; }
+    ~InLoop() { --loop_depth; }
+};
+
+}  // anonymous namespace
+
+
+ThreadPool::ThreadPool(size_t n)
+    : n_threads(n ? n : max(1u, thread::hardware_concurrency()))
+{
+}
+
+
+ThreadPool::~ThreadPool()
+{
+    {
+        lock_guard<mutex> lock(m);
+        stop = true;
+    }
+    wake.notify_all();
+    for(auto& t: threads) {
+        t.join();
+    }
+}
+
+
+ThreadPool&
+ThreadPool::Shared()
+{
+    static ThreadPool pool;
+    return pool;
+}
+
+
+void
+ThreadPool::Start()
+{
+    for(size_t i=0; i<n_threads; ++i) {
+        queues.emplace_back(new Queue());
+    }
+    for(size_t i=0; i<n_threads-1; ++i) {
+        threads.emplace_back(&ThreadPool::Worker, this, i);
+    }
+}
+
+
+void
+ThreadPool::Worker(size_t i)
+{
+    size_t seen = 0;
+    for(;;) {
+        {
+            unique_lock<mutex> lock(m);
+            wake.wait(lock, [&] { return stop || generation != seen; });
+            if(stop) {
+                return;
+            }
+            seen = generation;
+        }
+        while(RunOne(i)) {}
+    }
+}
+
+
+// run one chunk: from the back of the own queue, or stolen from the front of another
+bool
+ThreadPool::RunOne(size_t i)
+{
+    for(size_t k=0; k<queues.size(); ++k) {
+        Queue& q = *queues[(i + k) % queues.size()];
+        Task task;
+        {
+            lock_guard<mutex> lock(q.m);
+            if(q.tasks.empty()) {
+                continue;
+            }
+            if(k == 0) {
+                task = q.tasks.back();
+                q.tasks.pop_back();
+            } else {
+                task = q.tasks.front();
+                q.tasks.pop_front();
+            }
+        }
+        try {
+            InLoop in_loop;
+            (*task.f)(task.begin, task.end);
+        } catch(...) {
+            lock_guard<mutex> lock(m);
+            if(!error) {
+                error = current_exception();
+            }
+        }
+        if(--pending == 0) {
+            lock_guard<mutex> lock(m);
+            done.notify_all();
+        }
+        return true;
+    }
+    return false;
+}
+
+
+void
+ThreadPool::ParallelFor(size_t n, function<void(size_t, size_t)> const& f)
+{
+    if(loop_depth > 0) {
+        if(n > 0) {     // nested: the pool is busy with the outer loop (and `running` is held)
+            f(0, n);
+        }
+        return;
+    }
+
+    lock_guard<mutex> loop(running);
+    if(n_threads > 1 && threads.empty()) {
+        Start();
+    }
+    size_t workers = threads.size() + 1,
+           chunks = min(n, workers * 8);
+    if(workers == 1 || chunks < 2) {
+        if(n > 0) {
+            InLoop in_loop;
+            f(0, n);
+        }
+        return;
+    }
+
+    pending = chunks;
+    for(size_t c=0; c<chunks; ++c) {
+        Queue& q = *queues[c % workers];
+        lock_guard<mutex> lock(q.m);
+        q.tasks.push_back({ &f, n * c / chunks, n * (c+1) / chunks });
+    }
+    {
+        lock_guard<mutex> lock(m);
+        ++generation;
+    }
+    wake.notify_all();
+
+    while(RunOne(workers - 1)) {}
+    unique_lock<mutex> lock(m);
+    done.wait(lock, [&] { return pending == 0; });
+    if(error) {
+        exception_ptr e = error;
+        error = nullptr;
+        rethrow_exception(e);
+    }
+}
+
+
+/*
+ * LuaInterface
+ */
+
+void initialize_parallel(LuaInterface const& luax)
+{
+    // parallel_map(t, kernel, [out]) -> results of the kernel over the array `t`, in a
+    //                                   new table (or in `out`)
+    luax.RegisterFunction("parallel_map", [](lua_State* L) {
+        luaL_checktype(L, 1, LUA_TTABLE);
+        const char* name = luaL_checkstring(L, 2);
+        int out = 0;
+        if(!lua_isnoneornil(L, 3)) {
+            luaL_checktype(L, 3, LUA_TTABLE);
+            out = 3;
+        }
+
+        LuaInterface& luax = LuaInterface::get(L);
+        bool failed = false;
+        {
+            auto it = luax.kernels.find(name);
+            if(it == luax.kernels.end()) {
+                lua_pushfstring(L, "parallel_map: unknown kernel '%s'", name);
+                failed = true;
+            } else {
+                try {
+                    it->second(1, out);
+                } catch(LuaError&) {
+                    throw;      // (raised in Lua by TracedFunction, with its frames)
+                } catch(exception& e) {
+                    lua_pushfstring(L, "parallel_map: %s", e.what());
+                    failed = true;
+                } catch(...) {
+                    lua_pushfstring(L, "parallel_map: kernel '%s' failed (unknown exception)", name);
+                    failed = true;
+                }
+            }
+        }
+        if(failed) {
+            return lua_error(L);    // outside the block, so that no destructor is skipped
+        }
+        return 1;
+    });
+}
+
+
+}  // namespace lua
+
+// vim: ts=4:sw=4:sts=4:expandtab
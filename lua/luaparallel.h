@@ -0,0 +1,68 @@
+#ifndef LUA_LUAPARALLEL_H_
+#define LUA_LUAPARALLEL_H_
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+using namespace std;
+
+namespace lua {
+
+// work-stealing thread pool for data-parallel loops. The range is split in
+// chunks spread over one queue per thread; each thread takes from the back of
+// its own queue and, when it is empty, steals from the front of the others.
+// The calling thread works too. Threads are only started on the first loop.
+// The interfaces share one pool; their loops run one at a time, and a loop
+// started from inside a loop (by a kernel) runs inline, in its thread.
+class ThreadPool {
+public:
+    explicit ThreadPool(size_t n_threads = 0);     // 0: one per core
+    ~ThreadPool();
+
+    static ThreadPool& Shared();
+
+    // call f(begin, end) over [0, n), in parallel; rethrows the first exception
+    void ParallelFor(size_t n, function<void(size_t, size_t)> const& f);
+    size_t Threads() const { return n_threads; }
+
+private:
+    struct Task {
+        function<void(size_t, size_t)> const* f;
+        size_t begin, end;
+    };
+    struct Queue {
+        mutex       m;
+        deque<Task> tasks;
+    };
+
+    void Start();
+    void Worker(size_t i);
+    bool RunOne(size_t i);
+
+    size_t                    n_threads;
+    vector<thread>            threads;
+    vector<unique_ptr<Queue>> queues;        // one per worker, plus the caller's (last)
+
+    mutex                     running;       // held by the loop being run
+    mutex                     m;
+    condition_variable        wake, done;
+    size_t                    generation = 0;
+    bool                      stop = false;
+    atomic<size_t>            pending { 0 };  // chunks not finished
+    exception_ptr             error;
+
+    ThreadPool(ThreadPool const&) = delete;
+    ThreadPool& operator=(ThreadPool const&) = delete;
+};
+
+}  // namespace lua
+
+#endif  // LUA_LUAPARALLEL_H_
+
+// vim: ts=4:sw=4:sts=4:expandtab
@@ -0,0 +1,228 @@
+#include "luainterface.h"
+
+extern "C" {
+    #include <lua.h>
+    #include <lauxlib.h>
+    #include <lualib.h>
+}
+
+#include <cassert>
+#include <cctype>
+#include <cstdlib>
+
+namespace lua {
+
+/*
+ * LuaPath
+ */
+
+LuaPath::LuaPath(LuaPath&& other)
+    : text(move(other.text)), steps(move(other.steps)), cache_parent(other.cache_parent),
+      owner(other.owner), parent_ref(other.parent_ref), parent_valid(other.parent_valid)
+{
+    other.parent_ref = LUA_NOREF;
+    other.parent_valid = false;
+}
+
+
+LuaPath&
+LuaPath::operator=(LuaPath&& other)
+{
+    if(this != &other) {
+        Release();
+        text = move(other.text);
+        steps = move(other.steps);
+        cache_parent = other.cache_parent;
+        owner = other.owner;
+        parent_ref = other.parent_ref;
+        parent_valid = other.parent_valid;
+        other.parent_ref = LUA_NOREF;
+        other.parent_valid = false;
+    }
+    return *this;
+}
+
+
+LuaPath::~LuaPath()
+{
+    Release();
+}
+
+
+// the keys stay in the registry: they are shared by the paths (see path_keys)
+void
+LuaPath::Release()
+{
+    if(owner && parent_ref != LUA_NOREF) {
+        luaL_unref(owner->L(), LUA_REGISTRYINDEX, parent_ref);
+    }
+    parent_ref = LUA_NOREF;
+    parent_valid = false;
+}
+
+
+/*
+ * LuaInterface
+ */
+
+// name ('.' name | '[' integer ']' | '[' quoted string ']')*
+LuaPath
+LuaInterface::Path(string const& expr, bool cache_parent) const
+{
+    LuaPath path;
+    path.text = expr;
+    path.cache_parent = cache_parent;
+    path.owner = this;
+
+    auto key = [&](string const& k) {
+        auto it = path_keys.find(k);
+        if(it == path_keys.end()) {
+            lua_pushlstring(L(), k.data(), k.size());
+            it = path_keys.emplace(k, luaL_ref(L(), LUA_REGISTRYINDEX)).first;
+        }
+        LuaPath::Step step;
+        step.key = it->second;
+        path.steps.push_back(step);
+    };
+    auto invalid = [&](size_t i) {
+        Error("Invalid path `" + expr + "` at position " + to_string(i + 1) + ".");
+        path.steps.clear();
+    };
+
+    size_t i = 0, n = expr.size();
+    bool name_expected = true;
+    while(i < n) {
+        if(name_expected || expr[i] == '.') {
+            if(!name_expected) {
+                ++i;
+            }
+            size_t start = i;
+            while(i < n && (isalnum(static_cast<unsigned char>(expr[i])) || expr[i] == '_')) {
+                ++i;
+            }
+            if(i == start || isdigit(static_cast<unsigned char>(expr[start]))) {
+                invalid(start);
+                return path;
+            }
+            key(expr.substr(start, i - start));
+            name_expected = false;
+        } else if(expr[i] == '[') {
+            ++i;
+            if(i < n && (expr[i] == '"' || expr[i] == '\'')) {
+                char quote = expr[i++];
+                size_t end = expr.find(quote, i);
+                if(end == string::npos || end + 1 >= n || expr[end + 1] != ']') {
+                    invalid(i);
+                    return path;
+                }
+                key(expr.substr(i, end - i));
+                i = end + 2;
+            } else {
+                char* end;
+                long long index = strtoll(expr.c_str() + i, &end, 10);
+                size_t j = end - expr.c_str();
+                if(j == i || j >= n || expr[j] != ']') {
+                    invalid(i);
+                    return path;
+                }
+                LuaPath::Step step;
+                step.index = index;
+                path.steps.push_back(step);
+                i = j + 1;
+            }
+        } else {
+            invalid(i);
+            return path;
+        }
+    }
+    if(path.steps.empty()) {
+        invalid(0);
+    }
+    return path;
+}
+
+
+void
+LuaInterface::PushPathKey(LuaPath const& path) const
+{
+    LuaPath::Step const& step = path.steps.back();
+    if(step.key != LUA_NOREF) {
+        lua_rawgeti(L(), LUA_REGISTRYINDEX, step.key);
+    } else {
+        lua_pushinteger(L(), step.index);
+    }
+}
+
+
+// push the table that holds the last key, or nil (returning false) if some
+// step is not a table
+bool
+LuaInterface::PushPathParent(LuaPath const& path) const
+{
+    int s = StackSize();
+
+    if(path.steps.empty()) {
+        lua_pushnil(L());
+        return false;
+    }
+    if(path.parent_valid) {
+        lua_rawgeti(L(), LUA_REGISTRYINDEX, path.parent_ref);
+        return true;
+    }
+
+    lua_pushglobaltable(L());
+    for(size_t i=0; i+1 < path.steps.size(); ++i) {
+        LuaPath::Step const& step = path.steps[i];
+        if(step.key != LUA_NOREF) {
+            lua_rawgeti(L(), LUA_REGISTRYINDEX, step.key);
+            lua_rawget(L(), -2);
+        } else {
+            lua_rawgeti(L(), -1, step.index);
+        }
+        lua_remove(L(), -2);
+        if(!lua_istable(L(), -1)) {
+            lua_pop(L(), 1);
+            lua_pushnil(L());
+            return false;
+        }
+    }
+
+    if(path.cache_parent) {
+        lua_pushvalue(L(), -1);
+        if(path.parent_ref == LUA_NOREF) {
+            path.parent_ref = luaL_ref(L(), LUA_REGISTRYINDEX);
+        } else {
+            lua_rawseti(L(), LUA_REGISTRYINDEX, path.parent_ref);   // reuse the slot
+        }
+        path.parent_valid = true;
+    }
+
+    assert(StackSize() == s+1);
+    return true;
+}
+
+
+// push the value at the path (nil if it doesn't exist)
+void
+LuaInterface::PushPath(LuaPath const& path) const
+{
+    int s = StackSize();
+
+    if(PushPathParent(path)) {
+        LuaPath::Step const& step = path.steps.back();
+        if(step.key != LUA_NOREF) {
+            lua_rawgeti(L(), LUA_REGISTRYINDEX, step.key);
+            lua_rawget(L(), -2);
+        } else {
+            lua_rawgeti(L(), -1, step.index);
+        }
+        lua_remove(L(), -2);
+    }
+
+    assert(StackSize() == s+1);
+}
+
+
+}  // namespace lua
+
+// vim: ts=4:sw=4:sts=4:expandtab
@@ -0,0 +1,189 @@
+#include "luapool.h"
+
+extern "C" {
+    #include <lua.h>
+    #include <lauxlib.h>
+    #include <lualib.h>
+}
+
+#include <cassert>
+
+#include "luahelper.h"
+#include "luainterface.h"
+
+namespace lua {
+
+/*
+ * table pool
+ */
+
+int
+TablePool::ArrayShape(size_t n)
+{
+    if(n == 0) {
+        return EMPTY;
+    }
+    int shape = 0;
+    while(shape < 31 && (size_t(1) << shape) < n) {
+        ++shape;
+    }
+    return shape;
+}
+
+
+// the slots of the elements stay allocated when the table is cleared, so an
+// array of `n` holds at least the largest power of two <= n
+int
+TablePool::ReleasedShape(size_t n)
+{
+    if(n == 0) {
+        return EMPTY;
+    }
+    int shape = 0;
+    while(shape < 31 && (size_t(2) << shape) <= n) {
+        ++shape;
+    }
+    return shape;
+}
+
+
+bool
+TablePool::Take(lua_State* L, int shape)
+{
+    if(max_per_shape == 0) {
+        return false;
+    }
+    if(count[shape] == 0) {
+        ++stats.misses;
+        return false;
+    }
+
+    lua_rawgeti(L, LUA_REGISTRYINDEX, ref);
+    lua_rawgeti(L, -1, shape + 1);                          // pool list
+    lua_rawgeti(L, -1, static_cast<lua_Integer>(count[shape]));  // pool list t
+    lua_pushnil(L);
+    lua_rawseti(L, -3, static_cast<lua_Integer>(count[shape]--));
+    lua_replace(L, -3);                                     // t list
+    lua_pop(L, 1);
+
+    ++stats.hits;
+    return true;
+}
+
+
+// clear the table at `i` and keep it, if there is room for the shape
+void
+TablePool::Release(lua_State* L, int i, int shape)
+{
+    if(max_per_shape == 0 || count[shape] >= max_per_shape) {
+        ++stats.dropped;
+        return;
+    }
+    i = lua_absindex(L, i);
+
+    lua_pushnil(L);
+    while(lua_next(L, i)) {
+        lua_pop(L, 1);
+        lua_pushvalue(L, -1);
+        lua_pushnil(L);
+        lua_rawset(L, i);      // (clearing existing fields doesn't disturb lua_next)
+    }
+    if(shape != POINT) {
+        lua_pushnil(L);
+        lua_setmetatable(L, i);
+    }
+
+    if(ref == LUA_NOREF) {
+        lua_createtable(L, SHAPES, 0);
+        for(int s=1; s<=SHAPES; ++s) {
+            lua_newtable(L);
+            lua_rawseti(L, -2, s);
+        }
+        ref = luaL_ref(L, LUA_REGISTRYINDEX);
+    }
+    lua_rawgeti(L, LUA_REGISTRYINDEX, ref);
+    lua_rawgeti(L, -1, shape + 1);
+    lua_pushvalue(L, i);
+    lua_rawseti(L, -2, static_cast<lua_Integer>(++count[shape]));
+    lua_pop(L, 2);
+
+    ++stats.released;
+}
+
+
+void
+TablePool::Clear(lua_State* L)
+{
+    if(ref != LUA_NOREF) {
+        luaL_unref(L, LUA_REGISTRYINDEX, ref);
+        ref = LUA_NOREF;
+    }
+    for(auto& n: count) {
+        n = 0;
+    }
+}
+
+
+/*
+ * LuaInterface
+ */
+
+void
+LuaInterface::EnableTablePool(size_t max_per_shape) const
+{
+    if(max_per_shape == 0) {
+        table_pool.Clear(L());
+    }
+    table_pool.max_per_shape = max_per_shape;
+}
+
+
+void
+LuaInterface::ReleaseTable(int i) const
+{
+    int s = StackSize();
+
+    if(!lua_istable(L(), i)) {
+        Error("Expected table.");
+        return;
+    }
+    int shape;
+    if(lua_getmetatable(L(), i)) {
+        if(!point_class.Valid()) {
+            lua_getglobal(L(), "Point");
+            bool defined = lua_istable(L(), -1);
+            lua_pop(L(), 1);
+            if(defined) {
+                point_class = ResolveClass("Point");
+            }
+        }
+        bool point = point_class.Valid() && (lua_topointer(L(), -1) == point_class.ptr);
+        lua_pop(L(), 1);
+        if(!point) {
+            ++table_pool.stats.dropped;    // instances of other classes are not recycled
+            return;
+        }
+        shape = TablePool::POINT;
+    } else {
+        shape = TablePool::ReleasedShape(lua_rawlen(L(), i));
+    }
+    table_pool.Release(L(), i, shape);
+
+    assert(StackSize() == s);
+}
+
+
+void initialize_pool(LuaInterface const& luax)
+{
+    // release_table(t): give `t` back to the table pool (it must not be used anymore)
+    luax.RegisterFunction("release_table", [](lua_State* L) {
+        luaL_checktype(L, 1, LUA_TTABLE);
+        LuaInterface::get(L).ReleaseTable(1);
+        return 0;
+    });
+}
+
+
+}  // namespace lua
+
+// vim: ts=4:sw=4:sts=4:expandtab
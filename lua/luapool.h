@@ -0,0 +1,49 @@
+#ifndef LUA_LUAPOOL_H_
+#define LUA_LUAPOOL_H_
+
+extern "C" {
+    #include <lua.h>
+    #include <lauxlib.h>
+}
+
+#include <cstddef>
+
+namespace lua {
+
+struct TablePoolStats {
+    size_t hits     = 0;    // tables taken from the pool
+    size_t misses   = 0;    // tables created because the pool had none of the shape
+    size_t released = 0;    // tables given back to the pool
+    size_t dropped  = 0;    // released tables left to the GC (pool full, or disabled)
+};
+
+// recycled tables, by shape: arrays by capacity (shape k holds at least 2^k
+// elements), tables without elements, and Point instances. The free tables
+// are kept in Lua, in a table referenced from the registry; only the counts
+// are kept here.
+class TablePool {
+public:
+    static constexpr int POINT = 32;         // shape of the Point instances
+    static constexpr int EMPTY = 33;         // released with no elements (may have a hash part)
+    static constexpr int SHAPES = 34;
+
+    static int ArrayShape(size_t n);         // shape to take for `n` elements (rounded up)
+    static int ReleasedShape(size_t n);      // shape of a released array of `n` (rounded down)
+
+    bool Take(lua_State* L, int shape);      // push a cleared table of the shape, if any
+    void Release(lua_State* L, int i, int shape);
+    void Clear(lua_State* L);                // drop the free tables (left to the GC)
+
+    size_t         max_per_shape = 0;        // 0: disabled
+    TablePoolStats stats;
+
+private:
+    int    ref = LUA_NOREF;                  // lists of free tables, per shape (none yet)
+    size_t count[SHAPES] = {};
+};
+
+}  // namespace lua
+
+#endif  // LUA_LUAPOOL_H_
+
+// vim: ts=4:sw=4:sts=4:expandtab
@@ -0,0 +1,749 @@
+#include "luarecord.h"
+
+extern "C" {
+    #include <lua.h>
+    #include <lauxlib.h>
+    #include <lualib.h>
+}
+
+#include <algorithm>
+#include <cassert>
+#include <cstdio>
+#include <cstring>
+#include <iterator>
+#include <map>
+#include <vector>
+
+#include "luainterface.h"
+
+namespace lua {
+
+/*
+ * format
+ *
+ *   LOAD, DO         name:str nargs:u32 (0)
+ *   CALL, METHOD     name:str nargs:u32 value... (the receiver of a method is the first)
+ *   RESULTS          status:i32 elapsed_ns:u64 n:u32 value... (-1: left with an exception)
+ *   CFUNCTION        name:str n:u32 value...
+ *
+ * each entry record is followed by the CFUNCTION records of its registered C
+ * functions, and then by its RESULTS. A str is a u32 length and the bytes.
+ * The tables of the values of a record are numbered from 1, in the order they
+ * are written: a table seen again (a cycle, or a shared table) is a REF to it.
+ */
+
+namespace {
+
+enum Tag : uint8_t { NIL, BOOL_FALSE, BOOL_TRUE, NUMBER, INTEGER, STRING, TABLE, GLOBAL, OPAQUE, REF };
+const int MAX_DEPTH = 16;     // deeper tables are recorded as opaque
+
+
+// a part of a recording
+struct Reader {
+    const char* p;
+    const char* end;
+    int         tables = 0;       // (PushValues) tables read, by id
+    int         ntables = 0;
+
+    bool Done() const { return p >= end; }
+
+    const char* Bytes(size_t n) {
+        const char* r = p;
+        p += min(n, static_cast<size_t>(end - p));
+        return r;
+    }
+
+    uint8_t U8() { return Done() ? 0 : static_cast<uint8_t>(*p++); }
+
+    uint32_t U32() {
+        if(end - p < 4) {
+            p = end;
+            return 0;
+        }
+        auto b = reinterpret_cast<const unsigned char*>(Bytes(4));
+        return b[0] | (b[1] << 8) | (b[2] << 16) | (static_cast<uint32_t>(b[3]) << 24);
+    }
+
+    uint64_t U64() {
+        uint64_t lo = U32();
+        return lo | (static_cast<uint64_t>(U32()) << 32);
+    }
+
+    string String() {
+        size_t n = U32();
+        n = min(n, static_cast<size_t>(end - p));
+        return string(Bytes(n), n);
+    }
+
+    void PushValues(lua_State* L, int n);
+    void PushValue(lua_State* L);
+};
+
+
+void
+push_global(lua_State* L, const char* name)
+{
+    lua_pushglobaltable(L);
+    lua_pushstring(L, name);
+    lua_rawget(L, -2);
+    lua_remove(L, -2);
+}
+
+
+// push `n` values of a record (the tables they share are only read once)
+void
+Reader::PushValues(lua_State* L, int n)
+{
+    luaL_checkstack(L, n + 1, "too many values");
+    lua_newtable(L);
+    tables = lua_gettop(L);
+    ntables = 0;
+    for(int i=0; i<n; ++i) {
+        PushValue(L);
+    }
+    lua_remove(L, tables);
+    tables = 0;
+}
+
+
+void
+Reader::PushValue(lua_State* L)
+{
+    lua_checkstack(L, 4);
+    switch(U8()) {
+        case BOOL_FALSE:
+            lua_pushboolean(L, 0);
+            break;
+        case BOOL_TRUE:
+            lua_pushboolean(L, 1);
+            break;
+        case NUMBER: {
+                double d = 0;
+                if(end - p >= 8) {
+                    memcpy(&d, Bytes(8), 8);
+                }
+                lua_pushnumber(L, d);
+            }
+            break;
+        case INTEGER:
+            lua_pushinteger(L, static_cast<lua_Integer>(U64()));
+            break;
+        case STRING: {
+                string s = String();
+                lua_pushlstring(L, s.data(), s.size());
+            }
+            break;
+        case GLOBAL:
+            push_global(L, String().c_str());
+            break;
+        case TABLE: {
+                string mt = String();
+                lua_newtable(L);
+                if(tables) {
+                    lua_pushvalue(L, -1);
+                    lua_rawseti(L, tables, ++ntables);
+                }
+                while(!Done() && *p != NIL) {
+                    PushValue(L);
+                    PushValue(L);
+                    if(lua_isnil(L, -2)) {
+                        lua_pop(L, 2);
+                    } else {
+                        lua_rawset(L, -3);
+                    }
+                }
+                U8();      // end of the table
+                if(!mt.empty()) {
+                    push_global(L, mt.c_str());
+                    if(lua_istable(L, -1)) {
+                        lua_setmetatable(L, -2);
+                    } else {
+                        lua_pop(L, 1);
+                    }
+                }
+            }
+            break;
+        case REF: {
+                uint32_t id = U32();
+                if(tables && id >= 1 && id <= static_cast<uint32_t>(ntables)) {
+                    lua_rawgeti(L, tables, static_cast<int>(id));
+                } else {
+                    lua_pushnil(L);
+                }
+            }
+            break;
+        case OPAQUE:       // functions, userdata and threads are not recorded
+            String();
+            lua_pushnil(L);
+            break;
+        default:
+            lua_pushnil(L);
+    }
+}
+
+
+// replaces a registered C function: returns the next recorded results (the
+// upvalue is the queue of results, and t[0] the next index)
+int
+replay_stub(lua_State* L)
+{
+    lua_rawgeti(L, lua_upvalueindex(1), 0);
+    lua_Integer next = lua_tointeger(L, -1);
+    lua_pop(L, 1);
+    lua_rawgeti(L, lua_upvalueindex(1), next);
+    if(lua_isnil(L, -1)) {
+        return 0;          // called more often than in the recording
+    }
+    lua_pushinteger(L, next + 1);
+    lua_rawseti(L, lua_upvalueindex(1), 0);
+
+    size_t len;
+    const char* s = lua_tolstring(L, -1, &len);
+    Reader r { s, s + len };
+    int n = static_cast<int>(r.U32());
+    r.PushValues(L, n);
+    return n;
+}
+
+}  // anonymous namespace
+
+
+/*
+ * recorder
+ */
+
+bool
+Recorder::Start(string const& filename)
+{
+    Stop();
+    unique_ptr<ofstream> f(new ofstream(filename, ios::binary | ios::trunc));
+    if(!*f) {
+        return false;
+    }
+    f->write("LUAXREC1", 8);
+    out = move(f);
+    record.clear();
+    entry_depth = cfunction_depth = 0;
+    globals.clear();
+    written.clear();
+    return true;
+}
+
+
+void
+Recorder::Stop()
+{
+    if(out) {
+        out->flush();
+        out.reset();
+    }
+}
+
+
+bool
+Recorder::Enter(lua_State* L, Kind kind, const char* name, int nargs)
+{
+    if(entry_depth++ > 0) {
+        return false;
+    }
+    cfunction_depth = 0;      // (left over if a C function raised an error)
+
+    WriteString(name, strlen(name));
+    WriteU32(nargs);
+    written.clear();
+    int first = lua_gettop(L) - nargs + 1;
+    for(int i=0; i<nargs; ++i) {
+        WriteValue(L, first + i, (kind == METHOD && i == 0) ? -1 : 0);
+    }
+    Flush(kind);
+    return true;
+}
+
+
+void
+Recorder::Results(lua_State* L, int status, int nresults, uint64_t start)
+{
+    uint64_t elapsed = Tracer::Now() - start;
+    WriteU32(static_cast<uint32_t>(status));
+    WriteU32(static_cast<uint32_t>(elapsed));
+    WriteU32(static_cast<uint32_t>(elapsed >> 32));
+    WriteValues(L, nresults);
+    Flush(RESULTS);
+}
+
+
+bool
+Recorder::EnterCFunction()
+{
+    if(entry_depth == 0 || cfunction_depth > 0) {
+        return false;      // outside of the recorded calls, or called by another C function
+    }
+    ++cfunction_depth;
+    return true;
+}
+
+
+void
+Recorder::CFunctionResults(lua_State* L, const char* name, int nresults)
+{
+    --cfunction_depth;
+    WriteString(name, strlen(name));
+    WriteValues(L, nresults);
+    Flush(CFUNCTION);
+}
+
+
+string
+Recorder::Encode(lua_State* L, int n)
+{
+    string saved;
+    swap(saved, record);
+    WriteValues(L, n);
+    swap(saved, record);
+    return saved;
+}
+
+
+void
+Recorder::WriteValues(lua_State* L, int n)
+{
+    WriteU32(n);
+    written.clear();
+    int first = lua_gettop(L) - n + 1;
+    for(int i=0; i<n; ++i) {
+        WriteValue(L, first + i, 0);
+    }
+}
+
+
+// `i` is an absolute index; a depth of -1 is the receiver of a method, looked
+// up in the globals even if it was created after the last scan
+void
+Recorder::WriteValue(lua_State* L, int i, int depth)
+{
+    switch(lua_type(L, i)) {
+        case LUA_TNIL:
+            record.push_back(NIL);
+            break;
+        case LUA_TBOOLEAN:
+            record.push_back(lua_toboolean(L, i) ? BOOL_TRUE : BOOL_FALSE);
+            break;
+        case LUA_TNUMBER: {
+#if LUAX_INTEGER_SUBTYPE
+                if(lua_isinteger(L, i)) {
+                    uint64_t v = static_cast<uint64_t>(lua_tointeger(L, i));
+                    record.push_back(INTEGER);
+                    WriteU32(static_cast<uint32_t>(v));
+                    WriteU32(static_cast<uint32_t>(v >> 32));
+                    break;
+                }
+#endif
+                double d = lua_tonumber(L, i);
+                record.push_back(NUMBER);
+                record.append(reinterpret_cast<const char*>(&d), 8);
+            }
+            break;
+        case LUA_TSTRING: {
+                size_t len;
+                const char* s = lua_tolstring(L, i, &len);
+                record.push_back(STRING);
+                WriteString(s, len);
+            }
+            break;
+        case LUA_TTABLE: {
+                string const& name = GlobalName(L, lua_topointer(L, i), depth < 0);
+                if(!name.empty()) {
+                    record.push_back(GLOBAL);
+                    WriteString(name.data(), name.size());
+                    break;
+                }
+                auto seen = written.find(lua_topointer(L, i));
+                if(seen != written.end()) {
+                    record.push_back(REF);
+                    WriteU32(seen->second);
+                    break;
+                }
+                if(depth >= MAX_DEPTH) {
+                    record.push_back(OPAQUE);
+                    WriteString("table", 5);
+                    break;
+                }
+                uint32_t id = static_cast<uint32_t>(written.size() + 1);
+                written[lua_topointer(L, i)] = id;
+                record.push_back(TABLE);
+                if(lua_getmetatable(L, i)) {
+                    string const& mt = GlobalName(L, lua_topointer(L, -1), true);
+                    WriteString(mt.data(), mt.size());
+                    lua_pop(L, 1);
+                } else {
+                    WriteString("", 0);
+                }
+                lua_pushnil(L);
+                while(lua_next(L, i) != 0) {
+                    int top = lua_gettop(L);
+                    WriteValue(L, top - 1, max(depth, 0) + 1);
+                    WriteValue(L, top, max(depth, 0) + 1);
+                    lua_pop(L, 1);
+                }
+                record.push_back(NIL);
+            }
+            break;
+        default: {
+                const char* type = lua_typename(L, lua_type(L, i));
+                record.push_back(OPAQUE);
+                WriteString(type, strlen(type));
+            }
+    }
+}
+
+
+// name of a global table ("" if it is not one). The globals are scanned on the
+// first lookup, and again for unknown metatables and method receivers.
+string const&
+Recorder::GlobalName(lua_State* L, const void* table, bool rescan)
+{
+    static const string none;
+
+    auto it = globals.find(table);
+    if(it != globals.end() && !it->second.empty()) {
+        push_global(L, it->second.c_str());
+        bool same = (lua_topointer(L, -1) == table);
+        lua_pop(L, 1);
+        if(!same) {
+            it->second.clear();     // collected, and the address reused
+        }
+        return it->second;
+    } else if(it != globals.end() || (!rescan && !globals.empty())) {
+        return none;
+    }
+
+    lua_pushglobaltable(L);
+    lua_pushnil(L);
+    while(lua_next(L, -2) != 0) {
+        if(lua_type(L, -1) == LUA_TTABLE && lua_type(L, -2) == LUA_TSTRING) {
+            globals[lua_topointer(L, -1)] = lua_tostring(L, -2);
+        }
+        lua_pop(L, 1);
+    }
+    lua_pop(L, 1);
+
+    string& name = globals[table];     // "" if still unknown (not scanned again)
+    return name;
+}
+
+
+void
+Recorder::WriteString(const char* s, size_t len)
+{
+    WriteU32(static_cast<uint32_t>(len));
+    record.append(s, len);
+}
+
+
+void
+Recorder::WriteU32(uint32_t v)
+{
+    char b[4] = { static_cast<char>(v), static_cast<char>(v >> 8),
+                  static_cast<char>(v >> 16), static_cast<char>(v >> 24) };
+    record.append(b, 4);
+}
+
+
+void
+Recorder::Flush(Kind kind)
+{
+    if(out) {
+        uint32_t size = static_cast<uint32_t>(record.size());
+        char header[5] = { static_cast<char>(kind), static_cast<char>(size), static_cast<char>(size >> 8),
+                           static_cast<char>(size >> 16), static_cast<char>(size >> 24) };
+        out->write(header, 5);
+        out->write(record.data(), record.size());
+    }
+    record.clear();
+}
+
+
+void
+RecordScope::Begin(Recorder::Kind kind, const char* name, int nargs)
+{
+    recorded = recorder->Enter(L, kind, name, nargs);
+    start = Tracer::Now();
+}
+
+
+void
+RecordScope::End()
+{
+    if(recorded) {
+        recorder->Results(L, -1, 0, start);      // left with an exception
+    }
+    recorder->Leave();
+}
+
+
+/*
+ * LuaInterface
+ */
+
+bool
+LuaInterface::Record(string const& filename) const
+{
+    if(!recorder.Start(filename)) {
+        Error("Could not create recording " + filename);
+        return false;
+    }
+    return true;
+}
+
+
+void
+LuaInterface::StopRecording() const
+{
+    recorder.Stop();
+}
+
+
+// runs the calls of a recording again, in order: the scripts must be loaded
+// by the recording itself, and the registered C functions it used are
+// replaced by stubs returning the recorded results (restored at the end; the
+// names stay declared for strict.lua). Writes the timing of each call, and
+// how many calls returned other results than when recorded.
+bool
+LuaInterface::Replay(string const& filename, ostream& report) const
+{
+    int s = StackSize();
+
+    ifstream in(filename, ios::binary);
+    string data((istreambuf_iterator<char>(in)), istreambuf_iterator<char>());
+    if(data.size() < 8 || data.compare(0, 8, "LUAXREC1") != 0) {
+        Error("Not a recording: " + filename);
+        return false;
+    }
+
+    struct Entry {
+        Recorder::Kind kind;
+        Reader         body;
+    };
+    vector<Entry> records;
+    Reader r { data.data() + 8, data.data() + data.size() };
+    while(!r.Done()) {
+        auto kind = static_cast<Recorder::Kind>(r.U8());
+        size_t size = r.U32();
+        const char* body = r.Bytes(size);
+        records.push_back({ kind, Reader { body, r.p } });
+    }
+
+    // the fields replaced by the stubs, as (table, key, previous value) triples
+    lua_newtable(L());
+    int undo = lua_gettop(L());
+    int nundo = 0;
+    auto set = [&](int t) {       // t[key] = value, at the top
+        t = lua_absindex(L(), t);
+        lua_pushvalue(L(), t);
+        lua_rawseti(L(), undo, ++nundo);
+        lua_pushvalue(L(), -2);
+        lua_rawseti(L(), undo, ++nundo);
+        lua_pushvalue(L(), -2);
+        lua_rawget(L(), t);
+        lua_rawseti(L(), undo, ++nundo);
+        lua_rawset(L(), t);
+    };
+    auto restore = [&]() {
+        for(int i=nundo; i>0; i-=3) {
+            lua_rawgeti(L(), undo, i - 2);
+            lua_rawgeti(L(), undo, i - 1);
+            lua_rawgeti(L(), undo, i);
+            lua_rawset(L(), -3);
+            Pop();
+        }
+        nundo = 0;
+    };
+
+    // stubs: one queue of results per C function
+    lua_newtable(L());
+    int queues = lua_gettop(L());
+    for(auto const& rec: records) {
+        if(rec.kind != Recorder::CFUNCTION) {
+            continue;
+        }
+        Reader b = rec.body;
+        string name = b.String();
+        lua_getfield(L(), queues, name.c_str());
+        if(lua_isnil(L(), -1)) {
+            lua_pop(L(), 1);
+            lua_newtable(L());
+            lua_pushinteger(L(), 1);
+            lua_rawseti(L(), -2, 0);
+            lua_pushvalue(L(), -1);
+            lua_setfield(L(), queues, name.c_str());
+        }
+        lua_pushlstring(L(), b.p, b.end - b.p);
+        lua_rawseti(L(), -2, static_cast<int>(lua_rawlen(L(), -2)) + 1);
+        Pop();
+    }
+    lua_pushnil(L());
+    while(lua_next(L(), queues) != 0) {
+        string name = lua_tostring(L(), -2);
+        lua_pushcclosure(L(), replay_stub, 1);
+
+        // walk "a.b.c" from the globals, with raw access
+        lua_pushglobaltable(L());
+        size_t start = 0, dot;
+        while((dot = name.find('.', start)) != string::npos) {
+            string key = name.substr(start, dot - start);
+            lua_pushstring(L(), key.c_str());
+            lua_rawget(L(), -2);
+            if(!lua_istable(L(), -1)) {
+                Pop();
+                if(start == 0) {
+                    DeclareGlobal(key.c_str());
+                }
+                lua_newtable(L());
+                lua_pushstring(L(), key.c_str());
+                lua_pushvalue(L(), -2);
+                set(-4);
+            }
+            lua_remove(L(), -2);
+            start = dot + 1;
+        }
+        if(start == 0) {
+            DeclareGlobal(name.c_str());
+        }
+        lua_pushstring(L(), name.c_str() + start);
+        lua_pushvalue(L(), -3);
+        set(-3);
+        Pop(2);
+    }
+    Pop();
+
+    // entries
+    struct Stats {
+        int      calls = 0, errors = 0, diverged = 0;
+        uint64_t recorded = 0, replayed = 0, max = 0;
+    };
+    map<pair<int, string>, Stats> stats;
+    Recorder encoder;
+
+    try {
+        for(size_t i=0; i<records.size(); ++i) {
+            Recorder::Kind kind = records[i].kind;
+            if(kind != Recorder::LOAD && kind != Recorder::DO && kind != Recorder::CALL && kind != Recorder::METHOD) {
+                continue;
+            }
+            Reader b = records[i].body;
+            string name = b.String();
+            int nargs = static_cast<int>(b.U32());
+
+            Reader results { nullptr, nullptr };
+            for(size_t j=i+1; j<records.size() && records[j].kind != Recorder::LOAD && records[j].kind != Recorder::DO
+                    && records[j].kind != Recorder::CALL && records[j].kind != Recorder::METHOD; ++j) {
+                if(records[j].kind == Recorder::RESULTS) {
+                    results = records[j].body;
+                    break;
+                }
+            }
+            int recorded_status = static_cast<int32_t>(results.U32());
+            uint64_t recorded_elapsed = results.U64();
+            string recorded_values = results.p ? string(results.p, results.end - results.p) : string();
+            int nresults = (recorded_status == LUA_OK) ? static_cast<int>(Reader(results).U32()) : 0;
+
+            int top = lua_gettop(L());
+            int status = LUA_OK;
+            uint64_t start = Tracer::Now();
+            try {
+                switch(kind) {
+                    case Recorder::LOAD:
+                        LoadSource(name);
+                        if(lua_gettop(L()) > top) {
+                            status = LUA_ERRRUN;     // (the error message is left on the stack)
+                        }
+                        break;
+                    case Recorder::DO:
+                        status = luaL_loadstring(L(), name.c_str());
+                        if(status == LUA_OK) {
+                            status = Call(0, nresults);
+                        }
+                        break;
+                    case Recorder::CALL:
+                        push_global(L(), name.c_str());
+                        b.PushValues(L(), nargs);
+                        start = Tracer::Now();
+                        status = Call(nargs, nresults);
+                        break;
+                    case Recorder::METHOD:
+                        b.PushValues(L(), nargs);
+                        if(nargs == 0 || lua_isnil(L(), -nargs)) {
+                            status = LUA_ERRRUN;    // receiver not recorded (not a table)
+                            break;
+                        }
+                        lua_getfield(L(), -nargs, name.c_str());
+                        lua_insert(L(), -nargs - 1);
+                        start = Tracer::Now();
+                        status = Call(nargs, nresults);
+                        break;
+                    default:
+                        break;
+                }
+            } catch(LuaError const&) {
+                status = -1;
+            }
+            uint64_t elapsed = Tracer::Now() - start;
+
+            Stats& st = stats[make_pair(static_cast<int>(kind), name)];
+            ++st.calls;
+            st.recorded += recorded_elapsed;
+            st.replayed += elapsed;
+            st.max = max(st.max, elapsed);
+            if(status != LUA_OK) {
+                ++st.errors;
+            }
+            if(status != recorded_status
+                    || (status == LUA_OK && kind != Recorder::LOAD && encoder.Encode(L(), nresults) != recorded_values)) {
+                ++st.diverged;
+            }
+            lua_settop(L(), top);
+        }
+    } catch(...) {
+        lua_settop(L(), undo);
+        restore();
+        Pop();
+        throw;
+    }
+    restore();
+    Pop();
+
+    // report
+    static const char* kinds[] = { "", "load", "do", "call", "method" };
+    char line[512];
+    snprintf(line, sizeof line, "%-7s %7s %7s %9s %12s %12s %10s  %s\n",
+            "kind", "calls", "errors", "diverged", "recorded ms", "replayed ms", "max us", "name");
+    report << line;
+    Stats total;
+    for(auto const& e: stats) {
+        Stats const& st = e.second;
+        string name = e.first.second.substr(0, 60);
+        replace(begin(name), end(name), '\n', ' ');
+        snprintf(line, sizeof line, "%-7s %7d %7d %9d %12.3f %12.3f %10.1f  %s\n",
+                kinds[e.first.first], st.calls, st.errors, st.diverged,
+                st.recorded / 1e6, st.replayed / 1e6, st.max / 1e3, name.c_str());
+        report << line;
+        total.calls += st.calls;
+        total.errors += st.errors;
+        total.diverged += st.diverged;
+        total.recorded += st.recorded;
+        total.replayed += st.replayed;
+        total.max = max(total.max, st.max);
+    }
+    snprintf(line, sizeof line, "%-7s %7d %7d %9d %12.3f %12.3f %10.1f\n",
+            "total", total.calls, total.errors, total.diverged,
+            total.recorded / 1e6, total.replayed / 1e6, total.max / 1e3);
+    report << line;
+
+    assert(StackSize() == s);
+    return true;
+}
+
+
+}  // namespace lua
+
+// vim: ts=4:sw=4:sts=4:expandtab
@@ -0,0 +1,98 @@
+#ifndef LUA_LUARECORD_H_
+#define LUA_LUARECORD_H_
+
+#include <cstdint>
+#include <fstream>
+#include <memory>
+#include <string>
+#include <unordered_map>
+using namespace std;
+
+struct lua_State;
+
+namespace lua {
+
+// log of the host->Lua entry points (loads, Do, global functions and methods),
+// with their arguments and results, and of the results of the registered C
+// functions, to be replayed offline by luax-replay (see replay.cc).
+//
+// format: "LUAXREC1", then records { kind:u8 size:u32 payload }; integers are
+// little endian, numbers are doubles in host order. See luarecord.cc.
+class Recorder {
+public:
+    enum Kind : uint8_t { LOAD = 1, DO, CALL, METHOD, RESULTS, CFUNCTION };
+
+    ~Recorder() { Stop(); }
+
+    bool Start(string const& filename);
+    void Stop();
+    bool Enabled() const { return out != nullptr; }
+
+    // entry points: only the outermost one is recorded (nested calls are
+    // reproduced by replaying it)
+    bool Enter(lua_State* L, Kind kind, const char* name, int nargs);
+    void Results(lua_State* L, int status, int nresults, uint64_t start);
+    void Leave() { --entry_depth; }
+
+    // results of a registered C function (replayed by a stub returning them)
+    bool EnterCFunction();
+    void CFunctionResults(lua_State* L, const char* name, int nresults);
+    void LeaveCFunction() { --cfunction_depth; }     // (left with an exception)
+
+    // the `n` values at the top of the stack, as stored in a record
+    string Encode(lua_State* L, int n);
+
+private:
+    void WriteValues(lua_State* L, int n);
+    void WriteValue(lua_State* L, int i, int depth);
+    void WriteString(const char* s, size_t len);
+    void WriteU32(uint32_t v);
+    void Flush(Kind kind);
+    string const& GlobalName(lua_State* L, const void* table, bool rescan);
+
+    unique_ptr<ofstream>               out;
+    string                             record;      // payload being built
+    int                                entry_depth = 0;
+    int                                cfunction_depth = 0;
+    unordered_map<const void*, string> globals;     // global tables -> name ("" if unknown)
+    unordered_map<const void*, uint32_t> written;   // tables of the values being written -> id
+};
+
+
+// records an entry point for the scope, if the recorder is enabled
+class RecordScope {
+public:
+    RecordScope(Recorder& recorder, lua_State* L, Recorder::Kind kind, const char* name, int nargs)
+        : recorder(recorder.Enabled() ? &recorder : nullptr), L(L) {
+        if(this->recorder) {
+            Begin(kind, name, nargs);
+        }
+    }
+    ~RecordScope() { if(recorder) End(); }
+
+    // `nresults` values at the top of the stack (or the error message)
+    void Results(int status, int nresults) {
+        if(recorded) {
+            recorder->Results(L, status, nresults, start);
+            recorded = false;
+        }
+    }
+
+private:
+    void Begin(Recorder::Kind kind, const char* name, int nargs);
+    void End();
+
+    Recorder*  recorder;
+    lua_State* L;
+    bool       recorded = false;
+    uint64_t   start = 0;
+
+    RecordScope(RecordScope const&) = delete;
+    RecordScope& operator=(RecordScope const&) = delete;
+};
+
+}  // namespace lua
+
+#endif  // LUA_LUARECORD_H_
+
+// vim: ts=4:sw=4:sts=4:expandtab
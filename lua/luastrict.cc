@@ -0,0 +1,292 @@
+#include "luainterface.h"
+
+extern "C" {
+    #include <lua.h>
+    #include <lauxlib.h>
+    #include <lualib.h>
+}
+
+#include <cassert>
+#include <cstdint>
+#include <cstring>
+#include <set>
+#include <sstream>
+
+/*
+ * Static version of strict.lua: instead of checking each access to an
+ * undeclared global at runtime, the compiled chunk is dumped and its
+ * bytecode is scanned once, at load time, for GETTABUP/SETTABUP on _ENV.
+ *
+ * The dump format and the opcodes are those of Lua 5.3; with other Lua
+ * versions, `static_strict` is refused (see LoadMylib). The declarations are
+ * kept for the next chunks in the table of lazy globals, like `global` does.
+ */
+
+namespace lua {
+
+#if LUA_VERSION_NUM == 503
+
+namespace {
+
+struct BadChunk {};
+
+struct Proto {
+    vector<uint32_t>               code;
+    vector<pair<bool, string>>     constants;   // (is string, value)
+    vector<pair<uint8_t, uint8_t>> upvalues;    // (instack, idx)
+    vector<Proto>                  protos;
+    vector<int>                    lineinfo;
+};
+
+
+class ChunkReader {
+public:
+    explicit ChunkReader(string const& data) : p(data.data()), end(data.data() + data.size()) {}
+
+    Proto Chunk() {
+        static const char header[] = "\x1bLua\x53\x00\x19\x93\r\n\x1a\n";
+        if(end - p < 17 || memcmp(p, header, 12) != 0) {
+            throw BadChunk();
+        }
+        if(p[12] != sizeof(int) || p[13] != sizeof(size_t) || p[14] != sizeof(uint32_t)) {
+            throw BadChunk();
+        }
+        size_t skip = 17 + p[15] + p[16];       // + LUAC_INT + LUAC_NUM
+        Skip(skip);
+        Byte();                                 // number of upvalues of the main function
+        return Function();
+    }
+
+private:
+    void Skip(size_t n) {
+        if(static_cast<size_t>(end - p) < n) {
+            throw BadChunk();
+        }
+        p += n;
+    }
+
+    template<typename T> T Read() {
+        T v;
+        const char* q = p;
+        Skip(sizeof(T));
+        memcpy(&v, q, sizeof(T));
+        return v;
+    }
+
+    uint8_t Byte() { return Read<uint8_t>(); }
+    int     Int()  { return Read<int>(); }
+
+    string String() {
+        size_t size = Byte();
+        if(size == 0xFF) {
+            size = Read<size_t>();
+        }
+        if(size == 0) {
+            return "";
+        }
+        const char* q = p;
+        Skip(size - 1);
+        return string(q, size - 1);
+    }
+
+    Proto Function() {
+        Proto f;
+        String();                               // source
+        Int(); Int();                           // linedefined, lastlinedefined
+        Byte(); Byte(); Byte();                 // numparams, is_vararg, maxstacksize
+
+        for(int i=0, n=Int(); i<n; ++i) {
+            f.code.push_back(Read<uint32_t>());
+        }
+        for(int i=0, n=Int(); i<n; ++i) {
+            switch(Byte()) {
+                case 0:  f.constants.emplace_back(false, ""); break;                              // nil
+                case 1:  Byte(); f.constants.emplace_back(false, ""); break;                      // boolean
+                case 3:  Read<lua_Number>(); f.constants.emplace_back(false, ""); break;          // float
+                case 19: Read<lua_Integer>(); f.constants.emplace_back(false, ""); break;         // integer
+                case 4:
+                case 20: f.constants.emplace_back(true, String()); break;                         // string
+                default: throw BadChunk();
+            }
+        }
+        for(int i=0, n=Int(); i<n; ++i) {
+            uint8_t instack = Byte();
+            f.upvalues.emplace_back(instack, Byte());
+        }
+        for(int i=0, n=Int(); i<n; ++i) {
+            f.protos.push_back(Function());
+        }
+        for(int i=0, n=Int(); i<n; ++i) {
+            f.lineinfo.push_back(Int());
+        }
+        for(int i=0, n=Int(); i<n; ++i) {      // locals
+            String(); Int(); Int();
+        }
+        for(int i=0, n=Int(); i<n; ++i) {      // upvalue names
+            String();
+        }
+        return f;
+    }
+
+    const char* p;
+    const char* end;
+};
+
+
+enum { OP_LOADK = 1, OP_GETTABUP = 6, OP_SETTABUP = 8, OP_CALL = 36 };
+
+struct Access {
+    string name;
+    int    line;
+    bool   write;
+    bool   main;
+};
+
+
+void
+scan(Proto const& f, vector<bool> const& env, bool main, vector<Access>& accesses, set<string>& declared)
+{
+    auto rk_string = [&](unsigned rk, string& s) {
+        if(!(rk & 0x100) || (rk & 0xFF) >= f.constants.size() || !f.constants[rk & 0xFF].first) {
+            return false;
+        }
+        s = f.constants[rk & 0xFF].second;
+        return true;
+    };
+
+    int global_reg = -1;           // register holding `global`, while its arguments are loaded
+    vector<string> global_args;
+
+    for(size_t pc=0; pc < f.code.size(); ++pc) {
+        uint32_t i = f.code[pc];
+        unsigned op = i & 0x3F,
+                 a = (i >> 6) & 0xFF,
+                 c = (i >> 14) & 0x1FF,
+                 b = (i >> 23) & 0x1FF,
+                 bx = i >> 14;
+        int line = pc < f.lineinfo.size() ? f.lineinfo[pc] : 0;
+        string name;
+
+        if(op == OP_GETTABUP && b < env.size() && env[b] && rk_string(c, name)) {
+            accesses.push_back({ name, line, false, main });
+            if(name == "global") {
+                global_reg = a;
+                global_args.clear();
+            }
+        } else if(op == OP_SETTABUP && a < env.size() && env[a] && rk_string(b, name)) {
+            accesses.push_back({ name, line, true, main });
+        } else if(op == OP_LOADK && global_reg >= 0 && static_cast<int>(a) > global_reg
+                && bx < f.constants.size() && f.constants[bx].first) {
+            global_args.push_back(f.constants[bx].second);
+        } else if(op == OP_CALL && static_cast<int>(a) == global_reg) {
+            declared.insert(begin(global_args), end(global_args));
+            global_reg = -1;
+        }
+    }
+
+    for(auto const& p: f.protos) {
+        vector<bool> penv;
+        for(auto const& up: p.upvalues) {
+            penv.push_back(!up.first && up.second < env.size() && env[up.second]);
+        }
+        scan(p, penv, false, accesses, declared);
+    }
+}
+
+}  // anonymous namespace
+
+
+void
+LuaInterface::CheckGlobals(string const& chunkname) const
+{
+    int s = StackSize();
+
+    string data;
+    lua_dump(L(), [](lua_State*, const void* p, size_t sz, void* ud) {
+        reinterpret_cast<string*>(ud)->append(reinterpret_cast<const char*>(p), sz);
+        return 0;
+    }, &data, 0);
+
+    vector<Access> accesses;
+    set<string> declared;
+    try {
+        Proto main = ChunkReader(data).Chunk();
+        scan(main, { true }, true, accesses, declared);   // upvalue 0 of the main function is _ENV
+    } catch(BadChunk&) {
+        Error("Can't check the globals of " + chunkname + ": unsupported bytecode");
+        return;
+    }
+
+    // declared: assigned by a main chunk, passed to `global`, or already known
+    for(auto const& a: accesses) {
+        if(a.write && a.main) {
+            declared.insert(a.name);
+        }
+    }
+    lua_pushglobaltable(L());
+    lua_getfield(L(), LUA_REGISTRYINDEX, "mylib.lazy_globals");
+    if(lua_getmetatable(L(), -2)) {
+        lua_getfield(L(), -1, "__declared");
+    } else {
+        lua_pushnil(L());
+        lua_pushnil(L());
+    }                                           // _G lazy mt declared
+    auto known = [&](string const& name) {
+        for(int t: { -4, -3, -1 }) {            // _G, lazy mylib globals, strict declarations
+            if(lua_istable(L(), t)) {
+                lua_pushstring(L(), name.c_str());
+                lua_rawget(L(), t-1);
+                bool found = !lua_isnil(L(), -1);
+                lua_pop(L(), 1);
+                if(found) {
+                    return true;
+                }
+            }
+        }
+        return false;
+    };
+
+    stringstream ss;
+    set<string> reported;
+    for(auto const& a: accesses) {
+        if(declared.count(a.name) || reported.count(a.name) || (a.write && a.main) || known(a.name)) {
+            continue;
+        }
+        reported.insert(a.name);
+        ss << "\n  " << chunkname << ":" << a.line << ": "
+           << (a.write ? "assign to undeclared variable '" : "variable '") << a.name
+           << (a.write ? "'" : "' is not declared");
+    }
+
+    // remember the declarations for the chunks loaded later
+    if(lua_istable(L(), -3)) {
+        for(auto const& name: declared) {
+            lua_getfield(L(), -3, name.c_str());
+            if(lua_isnil(L(), -1)) {
+                lua_pushboolean(L(), false);
+                lua_setfield(L(), -5, name.c_str());
+            }
+            lua_pop(L(), 1);
+        }
+    }
+    lua_pop(L(), 4);
+
+    assert(StackSize() == s);
+
+    if(!reported.empty()) {
+        Error("Undeclared globals:" + ss.str());
+    }
+}
+
+#else
+
+void
+LuaInterface::CheckGlobals(string const&) const
+{
+}
+
+#endif
+
+}  // namespace lua
+
+// vim: ts=4:sw=4:sts=4:expandtab
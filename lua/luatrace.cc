@@ -0,0 +1,346 @@
+#include "luatrace.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cinttypes>
+#include <cstdio>
+#include <cstring>
+#include <unistd.h>
+
+#include "luainterface.h"
+
+namespace lua {
+
+/*
+ * tracer
+ */
+
+namespace {
+
+atomic<uint64_t> next_tracer_id { 1 };
+atomic<uint32_t> next_thread_id { 1 };
+
+// the buffers of the last tracers used in this thread, most recent first
+struct CachedBuffer {
+    uint64_t tracer_id;
+    void*    buffer;
+};
+const size_t CACHED_TRACERS = 8;
+
+thread_local struct {
+    CachedBuffer entries[CACHED_TRACERS];
+    size_t       n = 0;
+    uint32_t     tid = 0;
+} thread_cache;
+
+
+void
+write_json_string(ostream& out, const char* s)
+{
+    out << '"';
+    for(; *s; ++s) {
+        unsigned char c = static_cast<unsigned char>(*s);
+        if(c == '"' || c == '\\') {
+            out << '\\' << *s;
+        } else if(c < 0x20) {
+            char buf[8];
+            snprintf(buf, sizeof buf, "\\u%04x", c);
+            out << buf;
+        } else {
+            out << *s;
+        }
+    }
+    out << '"';
+}
+
+}  // anonymous namespace
+
+
+Tracer::Tracer()
+    : id(next_tracer_id++)
+{
+}
+
+
+Tracer::~Tracer()
+{
+}
+
+
+uint64_t
+Tracer::Now()
+{
+    return chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+
+Tracer::Buffer&
+Tracer::ThreadBuffer()
+{
+    auto& cache = thread_cache;
+    for(size_t k=0; k<cache.n; ++k) {
+        if(cache.entries[k].tracer_id == id) {
+            swap(cache.entries[0], cache.entries[k]);
+            return *reinterpret_cast<Buffer*>(cache.entries[0].buffer);
+        }
+    }
+    if(cache.tid == 0) {
+        cache.tid = next_thread_id++;
+    }
+
+    lock_guard<mutex> lock(m);
+    auto it = find_if(begin(buffers), end(buffers), [&](unique_ptr<Buffer> const& b) {
+        return b->tid == cache.tid;
+    });
+    if(it == end(buffers)) {
+        buffers.emplace_back(new Buffer(cache.tid));
+        it = end(buffers) - 1;
+    }
+    cache.n = min(cache.n + 1, CACHED_TRACERS);      // (the least recent one is dropped)
+    for(size_t k=cache.n-1; k>0; --k) {
+        cache.entries[k] = cache.entries[k - 1];
+    }
+    cache.entries[0] = { id, it->get() };
+    return **it;
+}
+
+
+// only the thread that owns the buffer inserts in its table; Export reads the
+// strings, which don't move
+const char*
+Tracer::Intern(const char* s)
+{
+    return ThreadBuffer().names.Intern(s);
+}
+
+
+const char*
+Tracer::InternShared(const char* s)
+{
+    lock_guard<mutex> lock(m);
+    return names.Intern(s);
+}
+
+
+const char*
+Tracer::Names::Intern(const char* s)
+{
+    auto it = index.find(s);
+    if(it != index.end()) {
+        return *it;
+    }
+    strings.emplace_back(s);
+    const char* interned = strings.back().c_str();
+    index.insert(interned);
+    return interned;
+}
+
+
+// FNV-1a
+size_t
+Tracer::Names::Hash::operator()(const char* s) const
+{
+    size_t h = 14695981039346656037ull;
+    for(; *s; ++s) {
+        h = (h ^ static_cast<unsigned char>(*s)) * 1099511628211ull;
+    }
+    return h;
+}
+
+
+bool
+Tracer::Names::Equal::operator()(const char* a, const char* b) const
+{
+    return strcmp(a, b) == 0;
+}
+
+
+// single writer per buffer
+void
+Tracer::Record(Event const& e)
+{
+    Buffer& b = ThreadBuffer();
+    uint64_t h = b.head.load(memory_order_relaxed);
+    b.begun.store(h + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    Slot& s = b.slots[h & (CAPACITY - 1)];
+    s.cat.store(e.cat, memory_order_relaxed);
+    s.name.store(e.name, memory_order_relaxed);
+    s.ts.store(e.ts, memory_order_relaxed);
+    s.dur.store(e.dur, memory_order_relaxed);
+    s.ph.store(e.ph, memory_order_relaxed);
+    b.head.store(h + 1, memory_order_release);
+}
+
+
+void
+Tracer::Complete(const char* cat, const char* name, uint64_t start)
+{
+    uint64_t now = Now();
+    Record({ cat, name, start, now - start, 'X' });
+}
+
+
+void
+Tracer::Instant(const char* cat, const char* name)
+{
+    if(Enabled()) {
+        Record({ cat, Intern(name), Now(), 0, 'i' });
+    }
+}
+
+
+// the buffers may be written while they are exported: the events are copied
+// first, and those overwritten during the copy are dropped
+void
+Tracer::Export(ostream& out) const
+{
+    lock_guard<mutex> lock(m);
+
+    out << "{\"traceEvents\":[";
+    bool first = true;
+    vector<Event> events;
+    for(auto const& b: buffers) {
+        uint64_t h = b->head.load(memory_order_acquire),
+                 from = (h > CAPACITY ? h - CAPACITY : 0);
+        events.clear();
+        for(uint64_t i = from; i < h; ++i) {
+            Slot const& s = b->slots[i & (CAPACITY - 1)];
+            events.push_back({ s.cat.load(memory_order_relaxed), s.name.load(memory_order_relaxed),
+                               s.ts.load(memory_order_relaxed), s.dur.load(memory_order_relaxed),
+                               s.ph.load(memory_order_relaxed) });
+        }
+        atomic_thread_fence(memory_order_acquire);
+        uint64_t begun = b->begun.load(memory_order_relaxed);
+        size_t skip = static_cast<size_t>(begun > CAPACITY + from ? min<uint64_t>(begun - CAPACITY - from, h - from) : 0);
+
+        for(size_t k = skip; k < events.size(); ++k) {
+            Event const& e = events[k];
+            char buf[96];
+            out << (first ? "\n" : ",\n") << "{\"name\":";
+            write_json_string(out, e.name);
+            out << ",\"cat\":";
+            write_json_string(out, e.cat);
+            snprintf(buf, sizeof buf, ",\"ph\":\"%c\",\"ts\":%" PRIu64 ".%03u", e.ph, 
+                    e.ts / 1000, static_cast<unsigned>(e.ts % 1000));
+            out << buf;
+            if(e.ph == 'X') {
+                snprintf(buf, sizeof buf, ",\"dur\":%" PRIu64 ".%03u", 
+                        e.dur / 1000, static_cast<unsigned>(e.dur % 1000));
+                out << buf;
+            } else {
+                out << ",\"s\":\"t\"";
+            }
+            out << ",\"pid\":" << getpid() << ",\"tid\":" << b->tid << "}";
+            first = false;
+        }
+    }
+    out << "\n],\"displayTimeUnit\":\"ms\"}\n";
+}
+
+
+// (only when no thread is recording)
+void
+Tracer::Clear()
+{
+    lock_guard<mutex> lock(m);
+    for(auto& b: buffers) {
+        b->begun.store(0, memory_order_relaxed);
+        b->head.store(0, memory_order_relaxed);
+    }
+}
+
+
+/*
+ * LuaInterface
+ */
+
+void
+LuaInterface::Trace(bool enable) const
+{
+    tracer.Enable(enable);
+}
+
+
+void
+LuaInterface::TraceExport(ostream& out, bool clear) const
+{
+    tracer.Export(out);
+    if(clear) {
+        tracer.Clear();
+    }
+}
+
+
+// registered C functions are called through this closure: upvalues are the
+// function, the interface, the name (interned in the tracer), and whether the
+// function is recorded (see luarecord.cc). It is also where exceptions stop:
+// a LuaError (or any std::exception) thrown by the function is raised as a
+// Lua error, after the C++ frames are unwound.
+int
+LuaInterface::TracedFunction(lua_State* L)
+{
+    lua_CFunction f = lua_tocfunction(L, lua_upvalueindex(1));
+    LuaInterface* lif = reinterpret_cast<LuaInterface*>(lua_touserdata(L, lua_upvalueindex(2)));
+    if(lif->raised) {
+        lif->raised.reset();    // (an error caught by the script)
+    }
+
+    // no destructors in the block: `f` may also leave with a Lua error
+    bool trace = lif->tracer.Enabled();
+    bool record = false;
+    bool failed = false;
+    uint64_t start = 0;
+    int r = 0;
+    const char* name = reinterpret_cast<const char*>(lua_touserdata(L, lua_upvalueindex(3)));
+    try {
+        record = lif->recorder.Enabled() && lua_toboolean(L, lua_upvalueindex(4))
+              && lif->recorder.EnterCFunction();
+        if(!trace && !record) {
+            r = f(L);
+        } else {
+            start = Tracer::Now();
+            r = f(L);
+            if(trace) {
+                lif->tracer.Complete("cfunction", name, start);
+            }
+            if(record) {
+                record = false;
+                lif->recorder.CFunctionResults(L, name, r);
+            }
+        }
+    } catch(LuaError& e) {
+        lif->raised.reset(new LuaError(move(e)));      // (found again by Traceback)
+        lua_pushstring(L, lif->raised->Message().c_str());
+        failed = true;
+    } catch(exception const& e) {
+        lua_pushstring(L, e.what());
+        failed = true;
+    }
+    if(failed) {
+        if(trace) {
+            lif->tracer.Complete("cfunction", name, start);
+        }
+        if(record) {
+            lif->recorder.LeaveCFunction();      // (its results are not recorded)
+        }
+        return lua_error(L);
+    }
+    return r;
+}
+
+
+void
+LuaInterface::PushFunction(string const& name, lua_CFunction f) const
+{
+    lua_pushcfunction(L(), f);
+    lua_pushlightuserdata(L(), const_cast<LuaInterface*>(this));
+    lua_pushlightuserdata(L(), const_cast<char*>(tracer.InternShared(name.c_str())));
+    lua_pushboolean(L(), host_functions);
+    lua_pushcclosure(L(), TracedFunction, 4);
+}
+
+
+}  // namespace lua
+
+// vim: ts=4:sw=4:sts=4:expandtab
@@ -0,0 +1,112 @@
+#ifndef LUA_LUATRACE_H_
+#define LUA_LUATRACE_H_
+
+#include <atomic>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <unordered_set>
+#include <vector>
+using namespace std;
+
+namespace lua {
+
+// timeline of calls across the Lua/C++ boundary, exported as Chrome trace
+// events (chrome://tracing, Perfetto). Each thread records into its own ring
+// buffer, without locks; when disabled, recording is a single flag check.
+// Names are interned once, when a scope starts (in the table of the thread:
+// no lock either) or when a function is registered (InternShared).
+class Tracer {
+public:
+    Tracer();
+    ~Tracer();
+
+    bool Enabled() const { return enabled.load(memory_order_relaxed); }
+    void Enable(bool v) { enabled.store(v, memory_order_relaxed); }
+
+    const char* Intern(const char* s);          // in the table of the calling thread
+    const char* InternShared(const char* s);    // in a table for all threads (locked)
+
+    void Complete(const char* cat, const char* name, uint64_t start);    // `name` interned
+    void Instant(const char* cat, const char* name);
+    void Export(ostream& out) const;
+    void Clear();
+
+    static uint64_t Now();     // steady_clock, in nanoseconds
+
+private:
+    // interned strings, looked up by C string (no std::string is built for a hit)
+    class Names {
+    public:
+        const char* Intern(const char* s);
+    private:
+        struct Hash { size_t operator()(const char* s) const; };
+        struct Equal { bool operator()(const char* a, const char* b) const; };
+        unordered_set<const char*, Hash, Equal> index;
+        deque<string>                           strings;    // (don't move)
+    };
+    struct Event {
+        const char* cat;
+        const char* name;      // interned
+        uint64_t    ts, dur;
+        char        ph;
+    };
+    // the slots are atomic, so that Export can read a buffer while its thread
+    // overwrites it (a seqlock: `begun` counts the writes started, `head` the
+    // writes done; a slot read is kept if no write to it had begun)
+    struct Slot {
+        atomic<const char*> cat, name;
+        atomic<uint64_t>    ts, dur;
+        atomic<char>        ph;
+    };
+    struct Buffer {
+        explicit Buffer(uint32_t tid) : tid(tid), slots(new Slot[CAPACITY]) {}
+        uint32_t                tid;
+        unique_ptr<Slot[]>      slots;
+        atomic<uint64_t>        begun { 0 };
+        atomic<uint64_t>        head { 0 };      // events written (the last CAPACITY are kept)
+        Names                   names;           // interned by this thread (never removed)
+    };
+    static constexpr size_t CAPACITY = 1 << 14;    // per thread, power of two
+
+    void Record(Event const& e);
+    Buffer& ThreadBuffer();
+
+    atomic<bool>              enabled { false };
+    uint64_t                  id;          // identifies this tracer in the thread-local cache
+    mutable mutex             m;           // buffer list and shared names (not taken when recording)
+    vector<unique_ptr<Buffer>> buffers;
+    Names                     names;
+
+    Tracer(Tracer const&) = delete;
+    Tracer& operator=(Tracer const&) = delete;
+};
+
+
+// records a complete event for the scope, if the tracer is enabled
+class TraceScope {
+public:
+    TraceScope(Tracer& tracer, const char* cat, const char* name)
+        : tracer(tracer.Enabled() ? &tracer : nullptr), cat(cat),
+          name(this->tracer ? tracer.Intern(name) : nullptr),
+          start(this->tracer ? Tracer::Now() : 0) {}
+    ~TraceScope() { if(tracer) tracer->Complete(cat, name, start); }
+
+private:
+    Tracer*     tracer;
+    const char* cat;
+    const char* name;
+    uint64_t    start;
+
+    TraceScope(TraceScope const&) = delete;
+    TraceScope& operator=(TraceScope const&) = delete;
+};
+
+}  // namespace lua
+
+#endif  // LUA_LUATRACE_H_
+
+// vim: ts=4:sw=4:sts=4:expandtab
@@ -0,0 +1,74 @@
+--
+-- mkbundle.lua
+-- packs precompiled Lua modules into a single bundle file, mounted at
+-- runtime with LoadBundle (see luamodules.cc)
+--
+-- usage: lua mkbundle.lua [-s] [-C dir] bundle file.lua...
+--   -s       strip debug information
+--   -C dir   module names are relative to `dir` (dir/a/b.lua -> a.b)
+--
+-- format (integers are 32-bit little endian):
+--   "LUAXBNDL" version count
+--   count * { name_offset name_len data_offset data_len adler32 }
+--   names and bytecode
+--
+
+local strip, base, out, files = false, nil, nil, {}
+local i = 1
+while i <= #arg do
+  if arg[i] == '-s' then
+    strip = true
+  elseif arg[i] == '-C' then
+    i = i+1
+    base = arg[i]:gsub('/*$', '/')
+  elseif not out then
+    out = arg[i]
+  else
+    files[#files+1] = arg[i]
+  end
+  i = i+1
+end
+assert(out, 'usage: lua mkbundle.lua [-s] [-C dir] bundle file.lua...')
+
+local function u32(n)
+  return string.char(n % 256, math.floor(n / 256) % 256, math.floor(n / 65536) % 256, math.floor(n / 16777216) % 256)
+end
+
+local function adler32(s)
+  local a, b = 1, 0
+  for j = 1, #s do
+    a = (a + s:byte(j)) % 65521
+    b = (b + a) % 65521
+  end
+  return b * 65536 + a
+end
+
+local modules = {}
+for _, file in ipairs(files) do
+  local name = file:gsub('^%./', '')
+  if base and name:sub(1, #base) == base then name = name:sub(#base+1) end
+  name = name:gsub('%.lua$', ''):gsub('/', '.')
+  modules[#modules+1] = { name = name, code = string.dump(assert(loadfile(file)), strip) }
+end
+
+local header_size = 16 + 20 * #modules
+local offset = header_size
+for _, m in ipairs(modules) do
+  m.name_offset = offset
+  offset = offset + #m.name
+end
+for _, m in ipairs(modules) do
+  m.data_offset = offset
+  offset = offset + #m.code
+end
+
+local f = assert(io.open(out, 'wb'))
+f:write('LUAXBNDL', u32(1), u32(#modules))
+for _, m in ipairs(modules) do
+  f:write(u32(m.name_offset), u32(#m.name), u32(m.data_offset), u32(#m.code), u32(adler32(m.code)))
+end
+for _, m in ipairs(modules) do f:write(m.name) end
+for _, m in ipairs(modules) do f:write(m.code) end
+f:close()
+
+-- vim: ts=2:sw=2:sts=2:expandtab
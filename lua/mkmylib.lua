@@ -0,0 +1,78 @@
+--
+-- mkmylib.lua
+-- generates mylib.h: the bytecode of each mylib module, and an index with
+-- the module names and the globals each module defines (used to load the
+-- modules lazily, see luamylib.cc)
+--
+-- usage: lua mkmylib.lua [-s] mylib/*.lua > mylib.h
+--   -s   strip debug information
+--
+
+local strip, files = false, {}
+for _, a in ipairs(arg) do
+  if a == '-s' then strip = true else files[#files+1] = a end
+end
+
+DEBUG = true   -- index debug-only globals as well
+
+-- globals defined by the main chunk of a module
+local function module_globals(file)
+  local env = setmetatable({}, { __index = _G })
+  env._G = env
+  assert(loadfile(file, 't', env))()
+  local globals = {}
+  for k in pairs(env) do
+    if k ~= '_G' and type(k) == 'string' then globals[#globals+1] = k end
+  end
+  table.sort(globals)
+  return globals
+end
+
+local function c_array(code)
+  local out = {}
+  for i = 1, #code, 12 do
+    local line = {}
+    for j = i, math.min(i+11, #code) do
+      line[#line+1] = string.format('0x%02x', code:byte(j))
+    end
+    out[#out+1] = '    ' .. table.concat(line, ', ')
+  end
+  return table.concat(out, ',\n')
+end
+
+print('/* generated by mkmylib.lua -- do not edit */')
+print('#ifndef LUA_MYLIB_H_')
+print('#define LUA_MYLIB_H_')
+print()
+print('#include <cstddef>')
+print()
+print('struct MylibModule {')
+print('    const char*          name;')
+print('    const unsigned char* code;')
+print('    size_t               len;')
+print('    const char* const*   globals;   // nullptr-terminated')
+print('};')
+print()
+
+local index = {}
+for _, file in ipairs(files) do
+  local name = file:match('([^/]+)%.lua$')
+  local code = string.dump(assert(loadfile(file)), strip)
+  local globals = module_globals(file)
+  for i, g in ipairs(globals) do globals[i] = '"' .. g .. '"' end
+  globals[#globals+1] = 'nullptr'
+
+  print(string.format('static const unsigned char mylib_%s_code[] = {\n%s\n};', name, c_array(code)))
+  print(string.format('static const char* const mylib_%s_globals[] = { %s };', name, table.concat(globals, ', ')))
+  print()
+  index[#index+1] = string.format('    { "%s", mylib_%s_code, sizeof mylib_%s_code, mylib_%s_globals },',
+    name, name, name, name)
+end
+
+print('static const MylibModule mylib_modules[] = {')
+print(table.concat(index, '\n'))
+print('};')
+print()
+print('#endif  // LUA_MYLIB_H_')
+
+-- vim: ts=2:sw=2:sts=2:expandtab
@@ -14,30 +14,16 @@ local last = {
   list = 0,
 }
 
--- read source file
+-- source file, read by line on demand (see source_line in luadebugger.cc)
 local function load_source(file)
-  if src[file] then
-    return src[file]
-  else
-    local lines = {}
-    local f = io.open(file, "r")
-    if not f then error('Could not open file '..file) end
-    while true do
-      local line = f:read()
-      if not line then
-        break
-      end
-      lines[#lines+1] = line
-    end
-    src[file] = lines
-    return lines
+  if not src[file] then
+    src[file] = setmetatable({}, { __index = function(_, n) return source_line(file, n) end })
   end
+  return src[file]
 end
 
 
-local function brk_debug(from_brk)
-  assert(debug.gethook() == nil)
-
+local function brk_debug()
   -- load stack info
   local stack = {}
   while true do
@@ -60,7 +46,6 @@ local function brk_debug(from_brk)
   local info = stack[level]
   local depth = #stack
   local src
-  if from_brk then depth = depth-1 end
 
   -- if the last command was a step, and we're still in the same source line, keep executing
   if last.command == 'step' and last.step == info.short_src..':'..info.currentline then
@@ -108,17 +93,17 @@ local function brk_debug(from_brk)
   -- step
   elseif input == 's' then
     last.command = 'step'
-    debug.sethook(function() debug.sethook(); brk_debug() end, 'l')
+    debug_step(function() brk_debug() end)
     return
   -- step
   elseif input == 'n' then
     last.command = 'next'
-    debug.sethook(function() debug.sethook(); brk_debug() end, 'l')
+    debug_step(function() brk_debug() end)
     return
   -- print expression
   elseif input:starts_with('p ') then
     -- add locals to environment
-    local env = shallow_copy(_ENV)
+    local env = shallow_copy(_ENV or _G)   -- (no _ENV in LuaJIT)
     local j = 1
     while debug.getlocal(level, j) do
       local k,v = debug.getlocal(level, j)
@@ -127,7 +112,7 @@ local function brk_debug(from_brk)
     end
     -- print expression
     local cmd = input:sub(3)
-    local ret = table.pack(pcall(load('return '..cmd, nil, 't', env)))
+    local ret = { pcall(load('return '..cmd, nil, 't', env)) }
     for i=2,#ret do p(ret[i]) end
     last.command = 'print'
   elseif input == 'l' then
@@ -162,7 +147,7 @@ end
 
 if DEBUG then
   function brk()
-      debug.sethook(function() debug.sethook(); brk_debug(true) end, 'c')
+      debug_step(function() brk_debug() end)
   end
 end
 
@@ -1,65 +1,5 @@
-function filter(table, func)
-  local new_table = {}
-  for _,v in ipairs(table) do
-    if func(v) then new_table[#new_table+1] = v end
-  end
-  return new_table
-end
-
-function filter_tbl(table, func)
-  local new_table = {}
-  for k,v in pairs(table) do
-    if func(k, v) then new_table[k] = v end
-  end
-  return new_table
-end
-
-function map(table, func)
-  local new_table = {}
-  for _,v in ipairs(table) do
-    new_table[#new_table+1] = func(v)
-  end
-  return new_table
-end
-
-function map_tbl(table, func)
-  local new_table = {}
-  for k,v in pairs(table) do
-    new_table[#new_table+1] = func(k, v)
-  end
-  return new_table
-end
-
-function partition(table, func)
-  local true_tbl, false_tbl = {}, {}
-  for _,v in ipairs(table) do
-    if func(v) then 
-      true_tbl[#true_tbl+1] = v 
-    else
-      false_tbl[#false_tbl+1] = v
-    end
-  end
-  return true_tbl, false_tbl
-end
-
-function flatten(list)
-  if type(list) ~= "table" then
-    return {list}
-  elseif list.is_a then
-    return {list}
-  end
-  local flat_list = {}
-  for _, elem in ipairs(list) do
-    for _, val in ipairs(flatten(elem)) do
-      flat_list[#flat_list + 1] = val
-    end
-  end
-  return flat_list
-end
-
-function compact(table)
-  return filter(table, function(i) return i ~= nil end)
-end
+-- filter, filter_tbl, map, map_tbl, partition, flatten and compact are
+-- implemented in C++ (see luafunctional.cc)
 
 function min(tbl, func)
   func = func or (function(x) return x end)
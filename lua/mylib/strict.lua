@@ -15,7 +15,13 @@ if mt == nil then
 end
 
 __STRICT = true
-mt.__declared = {}
+mt.__declared = {}    -- (`global` is defined by the interface, see luamylib.cc)
+
+-- globals are checked when chunks are loaded instead (see luastrict.cc)
+if __STATIC_STRICT then return end
+
+-- previous __index (the lazy loader of mylib globals, see luamylib.cc)
+local fallback = mt.__index
 
 mt.__newindex = function (t, n, v)
   if __STRICT and not mt.__declared[n] then
@@ -29,14 +35,15 @@ mt.__newindex = function (t, n, v)
 end
   
 mt.__index = function (t, n)
+  if fallback then
+    local v
+    if type(fallback) == 'function' then v = fallback(t, n) else v = fallback[n] end
+    if v ~= nil then return v end
+  end
   if not mt.__declared[n] and debug.getinfo(2, "S").what ~= "C" then
     error("variable '"..n.."' is not declared", 2)
   end
   return rawget(t, n)
 end
 
-function global(...)
-   for _, v in ipairs{...} do mt.__declared[v] = true end
-end
-
 end
@@ -0,0 +1,34 @@
+#include "luainterface.h"
+
+#include <iostream>
+using namespace std;
+
+//
+// luax-replay: runs a recording made with LuaInterface::Record again, and
+// prints the timing of each call (see luarecord.cc)
+//
+// usage: luax-replay [-p package.path] recording
+//
+int main(int argc, char* argv[])
+{
+    string path, recording;
+    for(int i=1; i<argc; ++i) {
+        if(string(argv[i]) == "-p" && i+1 < argc) {
+            path = argv[++i];
+        } else {
+            recording = argv[i];
+        }
+    }
+    if(recording.empty()) {
+        cerr << "usage: luax-replay [-p package.path] recording" << endl;
+        return 2;
+    }
+
+    lua::LuaInterface luax([](string const& s, void*) { cerr << s << endl; }, nullptr);
+    if(!path.empty()) {
+        luax.SetModulePath(path + ";;");
+    }
+    return luax.Replay(recording, cout) ? 0 : 1;
+}
+
+// vim: ts=4:sw=4:sts=4:expandtab
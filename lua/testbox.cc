@@ -2,16 +2,90 @@
 
 #include <cstdlib>
 #include <cstdio>
+#include <new>
 
 #include <iostream>
 using namespace std;
 
 #include "point.h"
 
+//
+// testbox: checks run by `make test` (the exit status is 1 if one fails)
+//
+
+// C++ heap allocations (the Lua state uses its own allocator, not counted)
+static size_t allocations = 0;
+
+void* operator new(size_t size)
+{
+    ++allocations;
+    if(void* p = malloc(size ? size : 1)) {
+        return p;
+    }
+    throw bad_alloc();
+}
+
+void operator delete(void* p) noexcept { free(p); }
+void operator delete(void* p, size_t) noexcept { free(p); }
+
+
+// a call with scalar and C string parameters must not allocate C++ memory
+// (see CStringRef and the forwarding of the parameters to Push)
+static bool
+CheckCallAllocations(lua::LuaInterface& luax)
+{
+    luax.Do("function test_add(a, b, s) return a + b + #s end; "
+            "function test_add2(a, b, s) return a + b, #s end");
+
+    double r = 0;
+    for(int i=0; i<10; ++i) {     // warm up
+        r += luax.CallGlobalFunction<double>("test_add", 1.0, 2, "abc");
+        r += get<1>(luax.CallGlobalFunction<tuple<double, int>>("test_add2", 1.0, 2, "abc"));
+    }
+    size_t allocated = allocations;
+    for(int i=0; i<1000; ++i) {
+        r += luax.CallGlobalFunction<double>("test_add", 1.0, 2, "abc");
+        r += get<1>(luax.CallGlobalFunction<tuple<double, int>>("test_add2", 1.0, 2, "abc"));
+    }
+    size_t n = allocations - allocated;
+    if(n > 0) {
+        printf("FAIL: %zu C++ allocations in 1000 calls\n", n);
+    }
+    return n == 0 && r > 0;
+}
+
+
+// cdata points and arrays of doubles are each read as their own kind
+static bool
+CheckFfi(lua::LuaInterface& luax)
+{
+#ifdef LUAX_LUAJIT
+    luax.Do("test_p = ffi_point(1, 2); test_a = ffi_doubles(3); test_a[2] = 5; test_e = ffi_doubles(0)");
+    luax.PushGlobal("test_p");
+    Point p = luax.Pop<Point>();
+    luax.PushGlobal("test_a");
+    vector<double> a = luax.Pop<vector<double>>();
+    luax.PushGlobal("test_e");
+    vector<double> e = luax.Pop<vector<double>>();
+    if(p.x != 1 || p.y != 2 || a.size() != 3 || a[2] != 5 || !e.empty()) {
+        puts("FAIL: FFI points and arrays");
+        return false;
+    }
+#else
+    (void) luax;
+#endif
+    return true;
+}
+
+
 int main()
 {
     lua::LuaInterface luax([](string s, void*) { cerr << s << endl; exit(1); }, nullptr);
 
+    if(!CheckCallAllocations(luax) || !CheckFfi(luax)) {
+        return 1;
+    }
+
     /*
     class Test {
     public:
@@ -33,6 +107,8 @@ int main()
 
     luax.Push(Point { 10, 200 });
     luax.StackDump();
+    luax.Pop();
+    luax.EnsureStackEmpty();
 
     return 0;
 }